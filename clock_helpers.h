@@ -0,0 +1,300 @@
+/**
+Clock helpers shared by jsonizer.cpp and gdb_helper.cpp, and scoped timers
+built on them.
+
+The timers aggregate per call site: SCOPED_TIMER(name) times the rest of the
+enclosing scope into a static TimerSite of its own, SCOPED_TIMER_OF(prefix,
+names,i) into the i-th of a static array of sites, e.g. one per factory.
+Sites of the same name, as those of the instantiations of a template, get
+reported together, sorted by total time, at exit.
+
+The macros expand to nothing unless JSONIZER_TIMERS is defined.
+*/
+
+#ifndef CLOCK_HELPERS_H
+#define CLOCK_HELPERS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+using HiResClock=std::chrono::high_resolution_clock;
+using Millisecs=std::chrono::milliseconds;
+
+inline void showts(std::chrono::time_point<std::chrono::system_clock> const& t)
+{
+static std::string format{"UTC: %d.%m.%Y %H:%M:%S"};
+auto tc{std::chrono::system_clock::to_time_t(t)};
+auto tt{*std::gmtime(&tc)};
+std::stringstream ss;
+ss << std::put_time(&tt,format.c_str())
+   << '.' << std::setfill('0') << std::setw(3)
+   << (std::chrono::duration_cast<Millisecs>(t.time_since_epoch())%1000)
+       .count();
+std::cout << ss.str() << std::endl;
+}
+
+//------------------------------------------------------------------------------
+/**
+Cheap timestamps: the TSC where the CPU reports it invariant, i.e. ticking at
+a constant rate regardless of frequency scaling and sleep states, otherwise
+steady_clock nanoseconds. TSC ticks get converted by their rate measured
+against steady_clock since start().
+*/
+struct TickClock
+{
+static bool tsc()
+{
+#if defined(__x86_64__)
+static const bool invariant{[]
+    {
+    unsigned a{},b{},c{},d{};
+    return __get_cpuid(0x80000007,&a,&b,&c,&d) && (d&(1u<<8));
+    }()};
+return invariant;
+#else
+return false;
+#endif
+}
+
+static std::uint64_t now()
+{
+#if defined(__x86_64__)
+if(tsc())
+    return __rdtsc();
+#endif
+return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void start()
+{
+epoch();
+}
+
+// Nanoseconds per tick, measured over at least 10 ms
+static double rate()
+{
+if(!tsc())
+    return 1;
+
+auto const& [tick0,time0]{epoch()};
+std::this_thread::sleep_until(time0+std::chrono::milliseconds(10));
+auto ns{std::chrono::duration<double,std::nano>(
+    std::chrono::steady_clock::now()-time0).count()};
+return ns/(now()-tick0);
+}
+
+private:
+
+static std::pair<std::uint64_t,std::chrono::steady_clock::time_point> const&
+    epoch()
+{
+static const std::pair res{now(),std::chrono::steady_clock::now()};
+return res;
+}
+};
+
+//------------------------------------------------------------------------------
+// Timings of one call site, in ticks, recorded lock-free by any thread
+struct TimerSite
+{
+static constexpr std::size_t BUCKETS{64};
+
+// Sites live on until after the report, which runs from atexit()
+explicit TimerSite(std::string name)
+    : mName(std::move(name))
+{
+TickClock::start();
+auto& r{registry()};
+static std::once_flag once;
+std::call_once(once,[]
+    {
+    std::atexit([]
+        {
+        report(std::cout);
+        });
+    });
+std::lock_guard lock{r.mux};
+r.sites.push_back(this);
+}
+
+void record(std::uint64_t ticks)
+{
+mCount.fetch_add(1,std::memory_order_relaxed);
+mTotal.fetch_add(ticks,std::memory_order_relaxed);
+for(auto min{mMin.load(std::memory_order_relaxed)}; ticks<min
+    && !mMin.compare_exchange_weak(min,ticks,std::memory_order_relaxed);)
+    ;
+for(auto max{mMax.load(std::memory_order_relaxed)}; ticks>max
+    && !mMax.compare_exchange_weak(max,ticks,std::memory_order_relaxed);)
+    ;
+auto bucket{ticks ? 64-__builtin_clzll(ticks) : 0};
+mBuckets[std::min<std::size_t>(bucket,BUCKETS-1)].fetch_add(
+    1,std::memory_order_relaxed);
+}
+
+/**
+All sites, merged by name, as a table sorted by total time: call count,
+total ms, mean, min and max ns, and the p50/p99 bucket bounds in ns.
+*/
+static void report(std::ostream& os)
+{
+struct Sum
+{
+std::uint64_t count{};
+std::uint64_t total{};
+std::uint64_t min{~std::uint64_t{}};
+std::uint64_t max{};
+std::array<std::uint64_t,BUCKETS> buckets{};
+};
+std::map<std::string,Sum> sums;
+{
+auto& r{registry()};
+std::lock_guard lock{r.mux};
+for(auto i: r.sites)
+    {
+    if(!i->mCount)
+        continue;
+    auto& s{sums[i->mName]};
+    s.count+=i->mCount;
+    s.total+=i->mTotal;
+    s.min=std::min<std::uint64_t>(s.min,i->mMin);
+    s.max=std::max<std::uint64_t>(s.max,i->mMax);
+    for(std::size_t j=0; j<BUCKETS; ++j)
+        s.buckets[j]+=i->mBuckets[j];
+    }
+}
+if(sums.empty())
+    return;
+
+std::vector<std::pair<std::string,Sum>> v(sums.begin(),sums.end());
+std::sort(v.begin(),v.end(),[](auto const& a, auto const& b)
+    {
+    return a.second.total>b.second.total;
+    });
+auto rate{TickClock::rate()};
+auto quantile{[rate](Sum const& s, double q)
+    {
+    std::uint64_t n{};
+    for(std::size_t i=0; i<BUCKETS; ++i)
+        if((n+=s.buckets[i])>=q*s.count)
+            return (std::uint64_t{1}<<i)*rate;
+    return s.max*rate;
+    }};
+std::stringstream ss;
+ss << "timers (" << (TickClock::tsc() ? "tsc" : "steady_clock")
+   << "): calls, total ms, mean / min / max / p50 < / p99 < ns\n"
+   << std::fixed << std::setprecision(1);
+for(auto const& [name,s]: v)
+    ss << "  " << name << ": " << s.count << ", " << s.total*rate/1e6
+       << ", " << s.total*rate/s.count << " / " << s.min*rate << " / "
+       << s.max*rate << " / " << quantile(s,0.5) << " / "
+       << quantile(s,0.99) << '\n';
+os << ss.str() << std::flush;
+}
+
+private:
+
+struct Registry
+{
+std::mutex mux;
+std::vector<TimerSite*> sites;
+};
+
+static Registry& registry()
+{
+static auto* r{new Registry};
+return *r;
+}
+
+std::string mName;
+std::atomic<std::uint64_t> mCount{};
+std::atomic<std::uint64_t> mTotal{};
+std::atomic<std::uint64_t> mMin{~std::uint64_t{}};
+std::atomic<std::uint64_t> mMax{};
+std::array<std::atomic<std::uint64_t>,BUCKETS> mBuckets{};
+};
+
+//------------------------------------------------------------------------------
+// N sites named prefix+names[i]
+template<std::size_t N> struct TimerSites
+{
+TimerSites(std::string const& prefix, char const* const (&names)[N])
+{
+for(std::size_t i=0; i<N; ++i)
+    mSites[i]=std::make_unique<TimerSite>(prefix+names[i]);
+}
+
+TimerSite& operator[](std::size_t i)
+{
+return *mSites[i];
+}
+
+private:
+
+std::array<std::unique_ptr<TimerSite>,N> mSites;
+};
+
+//------------------------------------------------------------------------------
+// Records the lifetime of the scope into a TimerSite
+struct ScopedTimer
+{
+explicit ScopedTimer(TimerSite& site)
+    : mSite(site)
+    , mBeg(TickClock::now())
+{}
+
+~ScopedTimer()
+{
+mSite.record(TickClock::now()-mBeg);
+}
+
+ScopedTimer(ScopedTimer const&)=delete;
+ScopedTimer& operator=(ScopedTimer const&)=delete;
+
+private:
+
+TimerSite& mSite;
+std::uint64_t mBeg;
+};
+
+#define CLOCK_HELPERS_CAT2(a,b) a##b
+#define CLOCK_HELPERS_CAT(a,b) CLOCK_HELPERS_CAT2(a,b)
+
+#ifdef JSONIZER_TIMERS
+#define SCOPED_TIMER(name) \
+static auto& CLOCK_HELPERS_CAT(timerSite,__LINE__){*new TimerSite(name)}; \
+ScopedTimer CLOCK_HELPERS_CAT(scopedTimer,__LINE__){ \
+    CLOCK_HELPERS_CAT(timerSite,__LINE__)}
+#define SCOPED_TIMER_OF(prefix,names,i) \
+static auto& CLOCK_HELPERS_CAT(timerSites,__LINE__){ \
+    *new TimerSites<std::size(names)>(prefix,names)}; \
+ScopedTimer CLOCK_HELPERS_CAT(scopedTimer,__LINE__){ \
+    CLOCK_HELPERS_CAT(timerSites,__LINE__)[i]}
+#else
+#define SCOPED_TIMER(name) ((void)0)
+#define SCOPED_TIMER_OF(prefix,names,i) ((void)0)
+#endif
+
+#endif
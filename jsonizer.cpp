@@ -54,14 +54,24 @@ response time, but the service triggering and response giving mechanisms
 (e.g. REST API) have yet to be implemented.
 */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cctype>
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <future>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -71,11 +81,40 @@ response time, but the service triggering and response giving mechanisms
 #include <set>
 #include <shared_mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <tuple>
+#include <unordered_set>
+#include <variant>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Scoped timers, compiled in with -DJSONIZER_TIMERS
+#include "clock_helpers.h"
+
+// Output codecs, compiled in with -DJSONIZER_ZLIB (link with -lz) and
+// -DJSONIZER_ZSTD (link with -lzstd)
+#ifdef JSONIZER_ZLIB
+#include <zlib.h>
+#endif
+#ifdef JSONIZER_ZSTD
+#include <zstd.h>
+#endif
+
 using namespace std::chrono_literals;
 
 namespace
@@ -96,7 +135,7 @@ using OptString=std::optional<std::string>;
 using Key=OptString;
 using Value=OptString;
 
-using Serial=int;
+using Serial=std::uint64_t;
 
 const std::size_t DEFAULT_MINSIZE{1};
 const std::size_t DEFAULT_MAXSIZE{2};
@@ -110,16 +149,31 @@ enum class CT
 ,OI,OD,OS,OA,OO,OM
 };
 
+const std::size_t CT_COUNT{15};
+const char* const CT_NAMES[CT_COUNT]{
+ "KI","KD","KS"
+,"AI","AD","AS","AA","AO","AM"
+,"OI","OD","OS","OA","OO","OM"
+};
+
 enum ERRORS
 {
 NO
 , USAGE
 , CMDLINE_INVALID_PREDEFINED
 , CMDLINE_EXCEPTION
+, CMDLINE_MISSING_OUTPUT
+, CORPUS_OUTPUT
+, BENCH_OUTPUT
+, REGRESSION
+, SERVE
+, LOAD
+, SNAPSHOT
+, ASSEMBLY
 };
 
-std::mutex muxCvProd,muxCvAsse,muxLog;
-std::condition_variable cvProd,cvAsse;
+std::mutex muxLog;
+bool g_verbose{true};
 
 void print(std::string const& s)
 {
@@ -129,6 +183,9 @@ std::cout << s << std::endl;
 #define LOG(data) ({std::lock_guard lock(muxLog); \
 std::stringstream ss__LINE__; ss__LINE__ << data; print(ss__LINE__.str());})
 
+// Progress logging, silenced with -q and in corpus mode
+#define LOGV(data) ({if(g_verbose) LOG(data);})
+
 V_S g_substantives {
 "abaxiator","adscititiouser","affranchiser","aoristicor","athwarter"
 ,"beaconacor","bheestier","biconcaver","blitherer","buckrammer"
@@ -157,10 +214,28 @@ V_S g_substantives {
 ,"yarner","yerker","yielder","yonderer","yummizer"
 ,"zagger","zanizer","zonator","zoomer","zymosizer"};
 
-Serial serialGenerator{};
+// Source of Part serial blocks, on a cache line of its own
+alignas(64) std::atomic<Serial> g_serialBlocks{};
+
+/**
+Part serials, unique process wide and never 0. Each thread takes them from
+a block of its own, so the shared counter gets touched once per block.
+*/
+Serial nextSerial()
+{
+static constexpr Serial BLOCK{4096};
+thread_local Serial next{};
+thread_local Serial end{};
+if(next==end)
+    {
+    next=g_serialBlocks.fetch_add(BLOCK,std::memory_order_relaxed)+1;
+    end=next+BLOCK;
+    }
+return next++;
+}
 
-std::random_device rd;
-std::mt19937 mt{rd()};
+// Per thread, as concurrent Producers draw from it
+thread_local std::mt19937 mt{std::random_device{}()};
 
 template<typename T, typename U>
 std::tuple<T&,U> tie2(T&& t, U&& u)
@@ -281,6 +356,143 @@ friend std::ostream& operator<<(std::ostream& os, DisNDat const& rhs)
 }
 };
 
+//------------------------------------------------------------------------------
+/**
+JSON string escaping. The scanners return the position of the first byte at
+or after pos needing an escape (quote, backslash or control character), or
+the size; the runs in between get copied as they are. The x86-64 ones test
+16 or 32 bytes at once, the widest the CPU supports being picked at startup.
+*/
+namespace escaping
+{
+std::size_t scanScalar(std::string_view s, std::size_t pos)
+{
+for(; pos<s.size(); ++pos)
+    {
+    auto c{static_cast<unsigned char>(s[pos])};
+    if(c<0x20 || c=='"' || c=='\\')
+        break;
+    }
+return pos;
+}
+
+#if defined(__x86_64__)
+// Tails shorter than a vector get tested by one more load, overlapping the
+// bytes already tested, which are shifted out of the mask
+inline unsigned hitsSse2(char const* p)
+{
+auto v{_mm_loadu_si128(reinterpret_cast<__m128i const*>(p))};
+auto const control{_mm_set1_epi8(0x1f)};
+return _mm_movemask_epi8(_mm_or_si128(
+    _mm_or_si128(
+        _mm_cmpeq_epi8(v,_mm_set1_epi8('"')),
+        _mm_cmpeq_epi8(v,_mm_set1_epi8('\\'))),
+    _mm_cmpeq_epi8(_mm_max_epu8(v,control),control)));
+}
+
+std::size_t scanSse2(std::string_view s, std::size_t pos)
+{
+if(s.size()<16)
+    return scanScalar(s,pos);
+
+for(; pos+16<=s.size(); pos+=16)
+    if(auto mask{hitsSse2(s.data()+pos)})
+        return pos+__builtin_ctz(mask);
+if(pos<s.size())
+    if(auto mask{hitsSse2(s.data()+s.size()-16)>>(pos+16-s.size())})
+        return pos+__builtin_ctz(mask);
+return s.size();
+}
+
+__attribute__((target("avx2")))
+inline unsigned hitsAvx2(char const* p)
+{
+auto v{_mm256_loadu_si256(reinterpret_cast<__m256i const*>(p))};
+auto const control{_mm256_set1_epi8(0x1f)};
+return _mm256_movemask_epi8(_mm256_or_si256(
+    _mm256_or_si256(
+        _mm256_cmpeq_epi8(v,_mm256_set1_epi8('"')),
+        _mm256_cmpeq_epi8(v,_mm256_set1_epi8('\\'))),
+    _mm256_cmpeq_epi8(_mm256_max_epu8(v,control),control)));
+}
+
+__attribute__((target("avx2")))
+std::size_t scanAvx2(std::string_view s, std::size_t pos)
+{
+if(s.size()<32)
+    return scanSse2(s,pos);
+
+for(; pos+32<=s.size(); pos+=32)
+    if(auto mask{hitsAvx2(s.data()+pos)})
+        return pos+__builtin_ctz(mask);
+if(pos<s.size())
+    if(auto mask{hitsAvx2(s.data()+s.size()-32)>>(pos+32-s.size())})
+        return pos+__builtin_ctz(mask);
+return s.size();
+}
+#endif
+
+using Scan=std::size_t (*)(std::string_view,std::size_t);
+
+Scan fastest()
+{
+#if defined(__x86_64__)
+return __builtin_cpu_supports("avx2") ? scanAvx2 : scanSse2;
+#else
+return scanScalar;
+#endif
+}
+
+void appendEscaped(std::string& out, std::string_view s, Scan scan)
+{
+static constexpr char HEX[]{"0123456789abcdef"};
+for(std::size_t pos{}; pos<s.size();)
+    {
+    auto end{scan(s,pos)};
+    out.append(s.data()+pos,end-pos);
+    if(end==s.size())
+        break;
+
+    auto c{static_cast<unsigned char>(s[end])};
+    out+='\\';
+    switch(c)
+        {
+        case '"':
+        case '\\':
+            out+=static_cast<char>(c);
+            break;
+        case '\b':
+            out+='b';
+            break;
+        case '\f':
+            out+='f';
+            break;
+        case '\n':
+            out+='n';
+            break;
+        case '\r':
+            out+='r';
+            break;
+        case '\t':
+            out+='t';
+            break;
+        default:
+            out+="u00";
+            out+=HEX[c>>4];
+            out+=HEX[c&0xf];
+        }
+    pos=end+1;
+    }
+}
+}
+
+// Appends s escaped for a JSON string, without the quotes
+void appendEscaped(std::string& out, std::string_view s)
+{
+static const escaping::Scan scan{escaping::fastest()};
+escaping::appendEscaped(out,s,scan);
+}
+
 //------------------------------------------------------------------------------
 template<typename T> std::string conv(T& t)
 {
@@ -289,7 +501,12 @@ return std::to_string(t);
 
 std::string conv(std::string const& t)
 {
-return "\"" + t + "\"";
+std::string s;
+s.reserve(t.size()+2);
+s+='"';
+appendEscaped(s,t);
+s+='"';
+return s;
 }
 
 template<typename T> std::string getFrom(
@@ -301,6 +518,387 @@ template<typename T> std::string getFrom(
     return conv(t[ix]);
 }
 
+//------------------------------------------------------------------------------
+// Lock-free, relaxed counter on a cache line of its own
+struct alignas(64) Counter
+{
+void operator+=(std::uint64_t rhs)
+{
+mVal.fetch_add(rhs,std::memory_order_relaxed);
+}
+
+void operator++()
+{
+*this+=1;
+}
+
+std::uint64_t get() const
+{
+return mVal.load(std::memory_order_relaxed);
+}
+
+private:
+
+std::atomic<std::uint64_t> mVal{};
+};
+
+//------------------------------------------------------------------------------
+// Lock-free histogram with power of two buckets: bucket N counts values
+// of less than 2^N
+struct Histogram
+{
+static constexpr std::size_t BUCKETS{40};
+
+void record(std::uint64_t val)
+{
+std::size_t ix{};
+while(ix<BUCKETS-1 && val>=(std::uint64_t{1}<<ix))
+    ++ix;
+mBuckets[ix].fetch_add(1,std::memory_order_relaxed);
+mCount+=1;
+mSum+=val;
+}
+
+std::uint64_t count() const
+{
+return mCount.get();
+}
+
+std::uint64_t sum() const
+{
+return mSum.get();
+}
+
+std::uint64_t bucket(std::size_t ix) const
+{
+return mBuckets[ix].load(std::memory_order_relaxed);
+}
+
+// Upper bound of the bucket holding the q quantile
+std::uint64_t quantile(double q) const
+{
+auto total{count()};
+std::uint64_t n{};
+for(std::size_t i=0; i<BUCKETS; ++i)
+    {
+    n+=bucket(i);
+    if(total && n>=q*total)
+        return std::uint64_t{1}<<i;
+    }
+return 0;
+}
+
+private:
+
+std::array<std::atomic<std::uint64_t>,BUCKETS> mBuckets{};
+Counter mCount;
+Counter mSum;
+};
+
+//------------------------------------------------------------------------------
+/**
+Process wide pipeline metrics, updated by all Producers and Assemblies, and
+dumped at exit, on SIGUSR1, as text or in Prometheus text format (-m).
+*/
+struct Metrics
+{
+std::array<Counter,CT_COUNT> factoryCalls;
+std::array<Counter,CT_COUNT> factoryBuilds;
+Counter recirculated;
+Counter assemblyRecirculated;
+Counter forceShipped;
+Counter shipped;
+Counter leavesOrdered;
+Counter leavesDelivered;
+Counter backpressureWaits;
+Counter inventoryDeposited;
+Counter inventoryWithdrawn;
+Counter inventoryExpired;
+Counter stockRefills;
+Counter parallelStitches;
+Counter compressedBlocks;
+Counter compressedBytesIn;
+Counter compressedBytesOut;
+Histogram partsDepth;
+Histogram productsDepth;
+Histogram requestLatencyUs;
+Histogram requestWastedPct;
+
+void dump(std::ostream& os, bool prometheus) const
+{
+if(prometheus)
+    {
+    auto counter{[&os](char const* name, std::uint64_t val)
+        {
+        os << "# TYPE jsonizer_" << name << " counter\n"
+           << "jsonizer_" << name << ' ' << val << '\n';
+        }};
+    auto factory{[&os](char const* name, auto const& counters)
+        {
+        os << "# TYPE jsonizer_" << name << " counter\n";
+        for(std::size_t i=0; i<CT_COUNT; ++i)
+            os << "jsonizer_" << name << "{factory=\"" << CT_NAMES[i]
+               << "\"} " << counters[i].get() << '\n';
+        }};
+    auto histogram{[&os](char const* name, Histogram const& h)
+        {
+        os << "# TYPE jsonizer_" << name << " histogram\n";
+        std::uint64_t n{};
+        for(std::size_t i=0; i<Histogram::BUCKETS-1; ++i)
+            {
+            n+=h.bucket(i);
+            os << "jsonizer_" << name << "_bucket{le=\""
+               << ((std::uint64_t{1}<<i)-1) << "\"} " << n << '\n';
+            }
+        os << "jsonizer_" << name << "_bucket{le=\"+Inf\"} " << h.count()
+           << "\njsonizer_" << name << "_sum " << h.sum()
+           << "\njsonizer_" << name << "_count " << h.count() << '\n';
+        }};
+    factory("factory_calls_total",factoryCalls);
+    factory("factory_builds_total",factoryBuilds);
+    counter("recirculated_total",recirculated.get());
+    counter("assembly_recirculated_total",assemblyRecirculated.get());
+    counter("force_shipped_total",forceShipped.get());
+    counter("shipped_total",shipped.get());
+    counter("leaves_ordered_total",leavesOrdered.get());
+    counter("leaves_delivered_total",leavesDelivered.get());
+    counter("backpressure_waits_total",backpressureWaits.get());
+    counter("inventory_deposited_total",inventoryDeposited.get());
+    counter("inventory_withdrawn_total",inventoryWithdrawn.get());
+    counter("inventory_expired_total",inventoryExpired.get());
+    counter("stock_refills_total",stockRefills.get());
+    counter("parallel_stitches_total",parallelStitches.get());
+    counter("compressed_blocks_total",compressedBlocks.get());
+    counter("compressed_bytes_in_total",compressedBytesIn.get());
+    counter("compressed_bytes_out_total",compressedBytesOut.get());
+    histogram("parts_depth",partsDepth);
+    histogram("products_depth",productsDepth);
+    histogram("request_latency_us",requestLatencyUs);
+    histogram("request_wasted_percent",requestWastedPct);
+    return;
+    }
+os << "factory: get() calls / builds\n";
+for(std::size_t i=0; i<CT_COUNT; ++i)
+    os << "  " << CT_NAMES[i] << ": " << factoryCalls[i].get() << " / "
+       << factoryBuilds[i].get() << '\n';
+auto ordered{leavesOrdered.get()};
+auto delivered{leavesDelivered.get()};
+os << "shipped: " << shipped.get()
+   << "\nrecirculated: " << recirculated.get()
+   << "\nassembly recirculated: " << assemblyRecirculated.get()
+   << "\nforce shipped (NOT CONSUMED): " << forceShipped.get()
+   << "\nleaves ordered / delivered: " << ordered << " / " << delivered
+   << "\nbackpressure waits: " << backpressureWaits.get()
+   << "\ninventory deposited / withdrawn / expired: "
+   << inventoryDeposited.get() << " / " << inventoryWithdrawn.get() << " / "
+   << inventoryExpired.get()
+   << "\nstock refills: " << stockRefills.get()
+   << "\nparallel stitches: " << parallelStitches.get()
+   << "\ncompressed blocks / bytes in / bytes out: "
+   << compressedBlocks.get() << " / " << compressedBytesIn.get() << " / "
+   << compressedBytesOut.get()
+   << "\nwasted parts ratio: "
+   << (ordered>delivered ? 1.0*(ordered-delivered)/ordered : 0.0) << '\n';
+auto histogram{[&os](char const* name, Histogram const& h)
+    {
+    os << name << ": count " << h.count() << ", mean "
+       << (h.count() ? 1.0*h.sum()/h.count() : 0.0)
+       << ", p50 < " << h.quantile(0.5) << ", p99 < " << h.quantile(0.99)
+       << '\n';
+    }};
+histogram("parts queue depth",partsDepth);
+histogram("products queue depth",productsDepth);
+histogram("request latency us",requestLatencyUs);
+histogram("request wasted %",requestWastedPct);
+}
+};
+
+Metrics g_metrics;
+
+volatile std::sig_atomic_t g_dumpMetrics{};
+
+//------------------------------------------------------------------------------
+/**
+Dumps g_metrics when SIGUSR1 arrives, polled by a thread of its own as the
+signal handler itself may not do I/O, and once more at destruction.
+*/
+struct MetricsReporter
+{
+explicit MetricsReporter(bool prometheus)
+    : mPrometheus(prometheus)
+{
+std::signal(SIGUSR1,[](int){g_dumpMetrics=1;});
+mThread=std::thread([this]
+    {
+    while(!mDone)
+        {
+        std::this_thread::sleep_for(100ms);
+        if(g_dumpMetrics)
+            {
+            g_dumpMetrics=0;
+            dump();
+            }
+        }
+    });
+}
+
+~MetricsReporter()
+{
+mDone=true;
+mThread.join();
+std::signal(SIGUSR1,SIG_DFL);
+dump();
+}
+
+void dump() const
+{
+std::stringstream ss;
+g_metrics.dump(ss,mPrometheus);
+LOG(ss.str());
+}
+
+private:
+
+bool mPrometheus{};
+std::atomic<bool> mDone{};
+std::thread mThread;
+};
+
+//------------------------------------------------------------------------------
+/**
+Chrome/Perfetto trace-event recorder (-T). Every thread records begin/end
+spans and instant events into a buffer of its own, and the buffers are
+written out as one trace JSON at shutdown. Recording is a no-op unless
+tracing has been enabled.
+*/
+struct Tracer
+{
+struct Event
+{
+char const* name;
+char ph;
+std::int64_t ts;
+std::int64_t arg;
+};
+
+struct Buffer
+{
+std::string thread;
+std::vector<Event> events;
+};
+
+static Tracer& instance()
+{
+static Tracer tracer;
+return tracer;
+}
+
+void enable()
+{
+mEpoch=std::chrono::steady_clock::now();
+mEnabled=true;
+}
+
+bool enabled() const
+{
+return mEnabled;
+}
+
+void name(std::string const& thread)
+{
+if(mEnabled)
+    buffer().thread=thread;
+}
+
+void record(char const* name, char ph, std::int64_t arg=-1)
+{
+if(!mEnabled)
+    return;
+
+auto ts{std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now()-mEpoch).count()};
+buffer().events.push_back({name,ph,ts,arg});
+}
+
+// To be called once all the recording threads are done
+bool write(std::string const& path)
+{
+std::ofstream out(path,std::ios::binary);
+out << "{\"traceEvents\":[";
+DisNDat<> c("",",\n");
+std::lock_guard lock{mMux};
+for(std::size_t tid=0; tid<mBuffers.size(); ++tid)
+    {
+    auto const& b{*mBuffers[tid]};
+    out << c << R"({"ph":"M","name":"thread_name","pid":1,"tid":)" << tid
+        << R"(,"args":{"name":")"
+        << (b.thread.empty() ? "thread "+std::to_string(tid) : b.thread)
+        << "\"}}";
+    for(auto const& e: b.events)
+        {
+        out << c << R"({"ph":")" << e.ph << R"(","name":")" << e.name
+            << R"(","pid":1,"tid":)" << tid << R"(,"ts":)" << e.ts/1000
+            << '.' << std::setfill('0') << std::setw(3) << e.ts%1000;
+        if(e.ph=='i')
+            out << R"(,"s":"t")";
+        if(e.arg>=0)
+            out << R"(,"args":{"serial":)" << e.arg << '}';
+        out << '}';
+        }
+    }
+out << "]}\n";
+return out.good();
+}
+
+private:
+
+Buffer& buffer()
+{
+thread_local Buffer* buffer{};
+if(!buffer)
+    {
+    std::lock_guard lock{mMux};
+    mBuffers.push_back(std::make_unique<Buffer>());
+    buffer=mBuffers.back().get();
+    }
+return *buffer;
+}
+
+std::atomic<bool> mEnabled{};
+std::chrono::steady_clock::time_point mEpoch;
+std::mutex mMux;
+std::vector<std::unique_ptr<Buffer>> mBuffers;
+};
+
+//------------------------------------------------------------------------------
+struct TraceSpan
+{
+explicit TraceSpan(char const* name)
+    : mName(name)
+{
+Tracer::instance().record(mName,'B');
+}
+
+~TraceSpan()
+{
+Tracer::instance().record(mName,'E');
+}
+
+private:
+
+char const* mName;
+};
+
+void traceInstant(char const* name, std::int64_t arg=-1)
+{
+Tracer::instance().record(name,'i',arg);
+}
+
+void traceThread(std::string const& name)
+{
+Tracer::instance().name(name);
+}
+
 //------------------------------------------------------------------------------
 struct Part;
 using PartPtr=std::shared_ptr<Part>;
@@ -325,6 +923,9 @@ enum class Type
     ,OBJECT
     };
 
+// Native value of a numeric leaf, for the binary encodings
+using Number=std::variant<std::monostate,std::int64_t,double>;
+
 static Type T2T(SimpleType const& type)
 {
 return type==SimpleType::INT
@@ -344,14 +945,14 @@ Part(
     ,Key const& key
     ,Value const& val=OptString()
     ,PartPtr sub=nullptr)
-    : mSerial(++serialGenerator)
+    : mSerial(nextSerial())
     , mType(type)
     , mKey(key)
     , mValue(val)
-    , mValueCount(isSimple() ? 1 : 0)
 {
 if(sub)
     mSubs=D_PartPtr{sub};
+render();
 }
 
 Part(
@@ -359,37 +960,53 @@ Part(
     ,OptD_PartPtr const& subs
     ,Key const& key
     ,Value const& val=OptString())
-    : mSerial(++serialGenerator)
+    : mSerial(nextSerial())
     , mType(type)
     , mKey(key)
     , mValue(val)
     , mSubs(subs)
-    , mValueCount(isSimple() ? 1 : 0)
-{}
+{
+render();
+}
 
 explicit Part(int val, OptString const& key=OptString())
-    : mSerial(++serialGenerator)
+    : mSerial(nextSerial())
     , mType(Type::INT)
     , mKey(key)
     , mValue(conv(val))
-    , mValueCount(1)
-{}
+    , mNumber(std::int64_t{val})
+{
+render();
+}
 
 explicit Part(double val, OptString const& key=OptString())
-    : mSerial(++serialGenerator)
+    : mSerial(nextSerial())
     , mType(Type::DOUBLE)
     , mKey(key)
     , mValue(conv(val))
-    , mValueCount(1)
+    , mNumber(val)
+{
+render();
+}
+
+// The simple value of leaf under another key
+Part(Part const& leaf, Key const& key)
+    : mSerial(nextSerial())
+    , mType(leaf.mType)
+    , mKey(key)
+    , mValue(leaf.mValue)
+    , mNumber(leaf.mNumber)
+    , mValueCounts(leaf.mValueCounts)
 {}
 
 explicit Part(std::string const& val, OptString const& key=OptString())
-    : mSerial(++serialGenerator)
+    : mSerial(nextSerial())
     , mType(Type::STRING)
     , mKey(key)
     , mValue(conv(val))
-    , mValueCount(1)
-{}
+{
+render();
+}
 
 bool match(SimpleType type) const
 {
@@ -402,15 +1019,7 @@ return type==SimpleType::INT
 
 std::size_t valueCount(SimpleType type) const
 {
-if(isSimple())
-    return mType==T2T(type) ? mValueCount : 0;
-
-std::size_t count{};
-if(mSubs)
-    for(auto const& i: *mSubs)
-        count+=i->valueCount(type);
-
-return count;
+return mValueCounts[static_cast<std::size_t>(type)];
 }
 
 Type type() const
@@ -438,64 +1047,209 @@ OptD_PartPtr& subs()
 return mSubs;
 }
 
+OptD_PartPtr const& subs() const
+{
+return mSubs;
+}
+
+Number const& number() const
+{
+return mNumber;
+}
+
 Serial const& serial() const
 {
 return mSerial;
 }
 
-private:
+// Container nesting, 0 for leaves
+unsigned depth() const
+{
+return mDepth;
+}
 
-Serial mSerial;
-Type mType;
-Key mKey;
-Value mValue;
-OptD_PartPtr mSubs;
-std::size_t mValueCount{};
+// Type and whether keyed, as the factories tell Parts apart
+static constexpr std::size_t KINDS{10};
 
-friend std::ostream& operator<<(std::ostream& os, Part const& rhs)
+std::size_t kind() const
 {
-if(rhs.mKey)
-    os << *rhs.mKey << ':';
+return static_cast<std::size_t>(mType)*2+(mKey ? 1 : 0);
+}
 
-switch(rhs.mType)
-    {
-    case Type::INT:
-    case Type::DOUBLE:
-    case Type::STRING:
-        os << *rhs.mValue;
-        break;
-    case Type::ARRAY:
-        os << '[';
-        if(rhs.mSubs)
-            {
-            DisNDat<> c("",",");
-            for(auto& i:*rhs.mSubs)
-                if(i)
-                    os << c << *i;
-            }
-        os << ']';
-        break;
-    case Type::OBJECT:
-        os << '{';
-        if(rhs.mSubs)
-            {
-            DisNDat<> c{"",","};
-            for(auto& i:*rhs.mSubs)
-                if(i)
-                    os << c << *i;
-            }
-        os << '}';
-    }
-return os;
+// Counts a round the Part went unconsumed at the work queue head
+unsigned miss()
+{
+return ++mMisses;
 }
 
-friend std::ostream& operator<<(std::ostream& os, Part::Type const& rhs)
+// Starts counting anew, once the Part left the work queue
+void clearMisses()
 {
-switch(rhs)
-    {
-    case Part::Type::INT:
-        os << "INT";
-        break;
+mMisses=0;
+}
+
+// Serialized length in bytes, including the "key": prefix when keyed
+std::size_t size() const
+{
+return (mKey ? mKey->size()+1 : 0)+(isSimple() ? mValue->size() : mBodySize);
+}
+
+void appendTo(std::string& out) const
+{
+if(mKey)
+    {
+    out+=*mKey;
+    out+=':';
+    }
+if(isSimple())
+    {
+    out+=*mValue;
+    return;
+    }
+for(auto const& i: mBody)
+    out+=*i;
+}
+
+// Writes what appendTo() appends, size() bytes, to out, returning its end
+char* copyTo(char* out) const
+{
+if(mKey)
+    {
+    memcpy(out,mKey->data(),mKey->size());
+    out+=mKey->size();
+    *out++=':';
+    }
+if(isSimple())
+    {
+    memcpy(out,mValue->data(),mValue->size());
+    return out+mValue->size();
+    }
+for(auto const& i: mBody)
+    {
+    memcpy(out,i->data(),i->size());
+    out+=i->size();
+    }
+return out;
+}
+
+private:
+
+// Immutable rendered text, shared by the containers splicing it
+using Fragment=std::shared_ptr<std::string const>;
+
+// Fragments this long get spliced by reference, shorter ones copied
+static constexpr std::size_t FRAGMENT_BYTES{4096};
+
+/**
+Containers never change after construction, so their text gets rendered
+here once, as a rope of fragments without the container's own key: the
+keys and leaves of the subs are written out, and the fragments of sub
+containers are spliced in, the long ones shared and only the short ones
+copied. Serialization then copies the fragments in order without walking
+the tree. Value counts get summed up at the same point.
+*/
+void render()
+{
+if(isSimple())
+    {
+    if(!mValue)
+        mValue=std::string();
+    if(mType!=Type::STRING && std::holds_alternative<std::monostate>(mNumber))
+        mNumber=parseNumber(*mValue,mType==Type::INT);
+    mValueCounts[static_cast<std::size_t>(
+        mType==Type::INT
+            ? SimpleType::INT
+            : mType==Type::DOUBLE ? SimpleType::DOUBLE : SimpleType::STRING)]=1;
+    return;
+    }
+std::string run;
+auto flush{[&]
+    {
+    if(run.empty())
+        return;
+    mBodySize+=run.size();
+    mBody.push_back(std::make_shared<std::string const>(std::move(run)));
+    run.clear();
+    }};
+
+std::size_t subs{};
+run+=mType==Type::ARRAY ? '[' : '{';
+if(mSubs)
+    for(auto const& i: *mSubs)
+        if(i)
+            {
+            if(subs++)
+                run+=',';
+            if(i->mKey)
+                {
+                run+=*i->mKey;
+                run+=':';
+                }
+            if(i->isSimple())
+                run+=*i->mValue;
+            else
+                for(auto const& j: i->mBody)
+                    if(j->size()<FRAGMENT_BYTES)
+                        run+=*j;
+                    else
+                        {
+                        flush();
+                        mBodySize+=j->size();
+                        mBody.push_back(j);
+                        }
+            mDepth=std::max(mDepth,i->mDepth);
+            for(std::size_t j=0; j<mValueCounts.size(); ++j)
+                mValueCounts[j]+=i->mValueCounts[j];
+            }
+run+=mType==Type::ARRAY ? ']' : '}';
+flush();
+mDepth=std::min(mDepth+1,0xff);
+}
+
+// Integers out of the int64 range, or not written as such, become doubles
+static Number parseNumber(std::string_view s, bool integer)
+{
+auto end{s.data()+s.size()};
+std::int64_t i{};
+if(integer)
+    {
+    auto [p,ec]{std::from_chars(s.data(),end,i)};
+    if(ec==std::errc() && p==end)
+        return i;
+    }
+double d{};
+std::from_chars(s.data(),end,d);
+return d;
+}
+
+Serial mSerial;
+Type mType;
+Key mKey;
+Value mValue;
+Number mNumber;
+OptD_PartPtr mSubs;
+std::vector<Fragment> mBody;
+std::size_t mBodySize{};
+std::array<std::size_t,3> mValueCounts{};
+std::uint8_t mDepth{};
+std::uint8_t mMisses{};
+
+friend std::ostream& operator<<(std::ostream& os, Part const& rhs)
+{
+std::string s;
+s.reserve(rhs.size());
+rhs.appendTo(s);
+os << s;
+return os;
+}
+
+friend std::ostream& operator<<(std::ostream& os, Part::Type const& rhs)
+{
+switch(rhs)
+    {
+    case Part::Type::INT:
+        os << "INT";
+        break;
     case Part::Type::DOUBLE:
         os << "DOUBLE";
         break;
@@ -512,147 +1266,692 @@ return os;
 }
 };
 
+//------------------------------------------------------------------------------
+/**
+CBOR (RFC 8949) and MessagePack writer walking the Part tree: numeric leaves
+get written from their native values and strings and keys from their JSON
+literals, unquoted and unescaped. Lengths are definite and numbers use their
+shortest encoding, except that doubles always take 8 bytes.
+*/
+struct Encoder
+{
+enum class Format
+{
+JSON
+, CBOR
+, MSGPACK
+};
+
+static std::optional<Format> parse(std::string const& s)
+{
+if(s=="json")
+    return Format::JSON;
+if(s=="cbor")
+    return Format::CBOR;
+if(s=="msgpack")
+    return Format::MSGPACK;
+return std::nullopt;
+}
+
+static char const* suffix(Format format)
+{
+return format==Format::CBOR
+    ? ".cbor"
+    : format==Format::MSGPACK ? ".msgpack" : ".json";
+}
+
+Encoder(Format format, std::string& out)
+    : mFormat(format)
+    , mOut(out)
+{}
+
+void map(std::size_t n)
+{
+if(mFormat==Format::CBOR)
+    head(5,n);
+else if(n<16)
+    mOut+=static_cast<char>(0x80|n);
+else
+    sized(n,0,0xde,0xdf);
+}
+
+void array(std::size_t n)
+{
+if(mFormat==Format::CBOR)
+    head(4,n);
+else if(n<16)
+    mOut+=static_cast<char>(0x90|n);
+else
+    sized(n,0,0xdc,0xdd);
+}
+
+void integer(std::int64_t v)
+{
+if(mFormat==Format::CBOR)
+    {
+    if(v<0)
+        head(1,~static_cast<std::uint64_t>(v));
+    else
+        head(0,v);
+    }
+else if(v>=-32 && v<128)
+    mOut+=static_cast<char>(v);
+else if(v>=0)
+    sized(v,0xcc,0xcd,0xce,0xcf);
+else if(v>=INT8_MIN)
+    big<std::uint8_t>(0xd0,v);
+else if(v>=INT16_MIN)
+    big<std::uint16_t>(0xd1,v);
+else if(v>=INT32_MIN)
+    big<std::uint32_t>(0xd2,v);
+else
+    big<std::uint64_t>(0xd3,v);
+}
+
+void real(double v)
+{
+std::uint64_t bits;
+memcpy(&bits,&v,sizeof bits);
+big<std::uint64_t>(mFormat==Format::CBOR ? 0xfb : 0xcb,bits);
+}
+
+// Text string from a quoted JSON string literal
+void string(std::string_view literal)
+{
+if(literal.size()>=2 && literal.front()=='"')
+    literal=literal.substr(1,literal.size()-2);
+if(literal.find('\\')==std::string_view::npos)
+    {
+    text(literal.size());
+    mOut+=literal;
+    return;
+    }
+std::string s;
+unescape(s,literal);
+text(s.size());
+mOut+=s;
+}
+
+void value(Part const& part)
+{
+switch(part.type())
+    {
+    case Part::Type::INT:
+    case Part::Type::DOUBLE:
+        if(auto i{std::get_if<std::int64_t>(&part.number())})
+            integer(*i);
+        else
+            real(std::get<double>(part.number()));
+        break;
+    case Part::Type::STRING:
+        string(*part.value());
+        break;
+    case Part::Type::ARRAY:
+    case Part::Type::OBJECT:
+        {
+        bool object{part.type()==Part::Type::OBJECT};
+        std::size_t n{};
+        if(part.subs())
+            for(auto const& i: *part.subs())
+                n+=i ? 1 : 0;
+        if(object)
+            map(n);
+        else
+            array(n);
+        if(part.subs())
+            for(auto const& i: *part.subs())
+                {
+                if(!i)
+                    continue;
+                if(object)
+                    member(*i);
+                else
+                    value(*i);
+                }
+        }
+    }
+}
+
+void member(Part const& part)
+{
+string(part.key() ? std::string_view(*part.key()) : std::string_view());
+value(part);
+}
+
+private:
+
+// CBOR initial byte of major type and argument n
+void head(unsigned major, std::uint64_t n)
+{
+major<<=5;
+if(n<24)
+    mOut+=static_cast<char>(major|n);
+else
+    sized(n,major|24,major|25,major|26,major|27);
+}
+
+// MessagePack str, CBOR text string
+void text(std::size_t n)
+{
+if(mFormat==Format::CBOR)
+    head(3,n);
+else if(n<32)
+    mOut+=static_cast<char>(0xa0|n);
+else
+    sized(n,0xd9,0xda,0xdb);
+}
+
+// n behind the marker for the smallest of 1, 2, 4 and 8 bytes that fits,
+// a zero marker meaning that size is not available
+void sized(
+    std::uint64_t n,
+    unsigned m8,
+    unsigned m16,
+    unsigned m32,
+    unsigned m64=0)
+{
+if(m8 && n<=UINT8_MAX)
+    big<std::uint8_t>(m8,n);
+else if(n<=UINT16_MAX)
+    big<std::uint16_t>(m16,n);
+else if(!m64 || n<=UINT32_MAX)
+    big<std::uint32_t>(m32,n);
+else
+    big<std::uint64_t>(m64,n);
+}
+
+template<typename T> void big(unsigned marker, std::uint64_t n)
+{
+mOut+=static_cast<char>(marker);
+for(auto i{sizeof(T)}; i--;)
+    mOut+=static_cast<char>(n>>(8*i));
+}
+
+static unsigned hex(std::string_view s)
+{
+unsigned v{};
+std::from_chars(s.data(),s.data()+std::min<std::size_t>(s.size(),4),v,16);
+return v;
+}
+
+static void utf8(std::string& out, unsigned c)
+{
+if(c<0x80)
+    out+=static_cast<char>(c);
+else if(c<0x800)
+    {
+    out+=static_cast<char>(0xc0|c>>6);
+    out+=static_cast<char>(0x80|(c&0x3f));
+    }
+else if(c<0x10000)
+    {
+    out+=static_cast<char>(0xe0|c>>12);
+    out+=static_cast<char>(0x80|(c>>6&0x3f));
+    out+=static_cast<char>(0x80|(c&0x3f));
+    }
+else
+    {
+    out+=static_cast<char>(0xf0|c>>18);
+    out+=static_cast<char>(0x80|(c>>12&0x3f));
+    out+=static_cast<char>(0x80|(c>>6&0x3f));
+    out+=static_cast<char>(0x80|(c&0x3f));
+    }
+}
+
+static void unescape(std::string& out, std::string_view s)
+{
+out.reserve(s.size());
+for(std::size_t i=0; i<s.size(); ++i)
+    {
+    if(s[i]!='\\' || i+1==s.size())
+        {
+        out+=s[i];
+        continue;
+        }
+    switch(auto c{s[++i]})
+        {
+        case 'b':
+            out+='\b';
+            break;
+        case 'f':
+            out+='\f';
+            break;
+        case 'n':
+            out+='\n';
+            break;
+        case 'r':
+            out+='\r';
+            break;
+        case 't':
+            out+='\t';
+            break;
+        case 'u':
+            {
+            auto u{hex(s.substr(i+1))};
+            i+=4;
+            if(u>=0xd800 && u<0xdc00 && i+6<s.size() && s[i+1]=='\\'
+               && s[i+2]=='u')
+                {
+                auto lo{hex(s.substr(i+3))};
+                if(lo>=0xdc00 && lo<0xe000)
+                    {
+                    u=0x10000+((u-0xd800)<<10)+(lo-0xdc00);
+                    i+=6;
+                    }
+                }
+            utf8(out,u);
+            break;
+            }
+        default:
+            out+=c;
+        }
+    }
+}
+
+Format mFormat;
+std::string& mOut;
+};
+
 //------------------------------------------------------------------------------
 struct MuxParts
 {
 void push_back(PartPtr p)
 {
+SCOPED_TIMER("MuxParts::push_back");
+std::unique_lock lock(mMux);
+mBytes+=p ? p->size() : 0;
+mParts.push_back(p);
+}
+
+/**
+Queues p unless full(size,bytes) holds for the queue as it is, returning
+whether it did. Checked and queued under one lock, so concurrent pushers
+cannot overfill the queue between the check and the push.
+*/
+template<typename Full> bool push_back(PartPtr p, Full const& full)
+{
+SCOPED_TIMER("MuxParts::push_back");
+std::unique_lock lock(mMux);
+if(full(mParts.size(),mBytes))
+    return false;
+mBytes+=p ? p->size() : 0;
+mParts.push_back(p);
+return true;
+}
+
+/**
+Queues p once full(size,bytes) no longer holds, waiting for notifyRoom() in
+between. Returns whether it had to wait.
+*/
+template<typename Full> bool waitPush(PartPtr p, Full const& full)
+{
+SCOPED_TIMER("MuxParts::waitPush");
 std::unique_lock lock(mMux);
+++mWaiters;
+bool waited{};
+mCvRoom.wait(lock,[&]
+    {
+    auto f{full(mParts.size(),mBytes)};
+    waited|=f;
+    return !f;
+    });
+--mWaiters;
+mBytes+=p ? p->size() : 0;
 mParts.push_back(p);
+return waited;
+}
+
+// Wakes the waitPush() callers to check for room again
+void notifyRoom()
+{
+if(!mWaiters)
+    return;
+std::unique_lock lock(mMux);
+mCvRoom.notify_all();
+}
+
+// Moves the head Part to the back
+void rotate()
+{
+SCOPED_TIMER("MuxParts::rotate");
+std::unique_lock lock(mMux);
+if(mParts.empty())
+    return;
+mParts.push_back(std::move(mParts.front()));
+mParts.pop_front();
 }
 
 void pop_front()
 {
+SCOPED_TIMER("MuxParts::pop_front");
 std::unique_lock lock(mMux);
+if(mParts.front())
+    mBytes-=mParts.front()->size();
 mParts.pop_front();
 }
 
 bool empty()
 {
+SCOPED_TIMER("MuxParts::empty");
 std::shared_lock lock(mMux);
 return mParts.empty();
 }
 
 std::size_t size()
 {
+SCOPED_TIMER("MuxParts::size");
 std::shared_lock lock(mMux);
 return mParts.size();
 }
 
+// Serialized size of the queued Parts, as an estimate of their memory
+std::size_t bytes()
+{
+SCOPED_TIMER("MuxParts::bytes");
+std::shared_lock lock(mMux);
+return mBytes;
+}
+
 PartPtr const& front()
 {
+SCOPED_TIMER("MuxParts::front");
 std::shared_lock lock(mMux);
 return mParts.front();
 }
 
+// Queued Parts by Part::kind()
+std::array<std::size_t,Part::KINDS> composition()
+{
+SCOPED_TIMER("MuxParts::composition");
+std::shared_lock lock(mMux);
+std::array<std::size_t,Part::KINDS> res{};
+for(auto const& i: mParts)
+    if(i)
+        ++res[i->kind()];
+return res;
+}
+
 PartPtr get()
 {
+SCOPED_TIMER("MuxParts::get");
 std::unique_lock lock(mMux);
 if(mParts.empty())
     return PartPtr();
 
 auto part{mParts.front()};
 mParts.pop_front();
+if(part)
+    mBytes-=part->size();
 return part;
 }
 
 private:
 
 std::shared_mutex mMux;
+std::condition_variable_any mCvRoom;
+std::atomic<std::size_t> mWaiters{};
 D_PartPtr mParts;
+std::size_t mBytes{};
 };
 
 //------------------------------------------------------------------------------
+// Appends the digits of val in base BASE, most significant first, the digit 0
+// being written as zero; 0 itself has no digits
 template<std::size_t BASE> struct BaseN
 {
-explicit BaseN(char zero)
-    : mZero(zero)
-{}
-
-BaseN& operator++()
+static void append(std::string& s, std::size_t val, char zero)
 {
-++mVal;
-return *this;
+char digits[64];
+auto end{digits+sizeof digits};
+auto p{end};
+for(; val; val/=BASE)
+    *--p=static_cast<char>(zero+val%BASE);
+s.append(p,end);
 }
+};
 
-BaseN operator++(int)
+//------------------------------------------------------------------------------
+/**
+Key names and value literals, the latter in groups indexed by SimpleType, as
+views sharing the ownership of what they view: owned strings, a mapped
+Snapshot or Corpus. Keys come escaped for JSON and literals rendered, unless
+raw, when they get escaped (and quoted) as they are drawn.
+*/
+struct Pools
 {
-BaseN base{*this};
-++mVal;
-return base;
-}
+using V_SV=std::vector<std::string_view>;
+using Views=std::shared_ptr<V_SV const>;
 
-std::string operator*()
+template<typename Owner> static Views views(
+    std::shared_ptr<Owner> const& owner,
+    V_SV const& v)
 {
-auto val{mVal};
-std::string s;
-while(val)
-    {
-    auto digit{static_cast<std::size_t>(val%BASE)};
-    val=(val-digit)/BASE;
-    s=std::string(1,mZero+digit)+s;
-    }
-return s;
+return Views(owner,&v);
 }
 
-private:
-
-char mZero;
-std::size_t mVal{};
+Views keys;
+std::array<std::vector<Views>,3> literals;
+bool rawKeys{};
+bool rawStrings{};
 };
 
 //------------------------------------------------------------------------------
-struct KeyGetterBase
+// A whole file mapped read-only
+struct MappedFile
 {
-using Token=std::size_t;
-
-virtual ~KeyGetterBase() = default;
-virtual std::size_t keyCount(Token) const = 0;
-virtual std::string get(Token) const = 0;
-
-virtual Token reg()
+explicit MappedFile(std::string const& path)
 {
-return 0;
+int fd{open(path.c_str(),O_RDONLY)};
+if(fd<0)
+    throw std::runtime_error("cannot open "+path);
+
+struct stat st{};
+void* base{fstat(fd,&st) || !st.st_size
+    ? MAP_FAILED
+    : mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0)};
+close(fd);
+if(base==MAP_FAILED)
+    throw std::runtime_error("cannot map "+path);
+
+mData=static_cast<char const*>(base);
+mSize=st.st_size;
 }
 
-virtual void activate(){}
-};
-
-using KeyGetterBasePtr = std::shared_ptr<KeyGetterBase>;
+MappedFile(MappedFile const&)=delete;
+MappedFile& operator=(MappedFile const&)=delete;
 
-//------------------------------------------------------------------------------
-struct KeyGetter : public KeyGetterBase
+~MappedFile()
 {
-KeyGetter(V_S names, std::size_t count)
-{
-if(!count)
-    mKeys.swap(names);
-else
-    {
-    mKeys=names;
-    BaseN<1+'z'-'a'> b{'a'};
-    for(; count; --count, ++b)
-        {
-        auto s{*b};
-        if(!s.empty())
-            s="_"+s;
-        for(auto const& i: names)
-            mKeys.emplace_back(i+s);
-        }
-    }
-mSlice=mKeys.size();
+munmap(const_cast<char*>(mData),mSize);
 }
 
-std::size_t keyCount(Token tok) const override
+char const* data() const
 {
-auto next{tok*mSlice+mSlice};
-auto tail{mKeys.size()-next};
-return tail>0 && tail<mSlice ? mSlice+tail : mSlice;
+return mData;
 }
 
-std::string get(Token tok) const override
+std::size_t size() const
 {
-return getFrom(mKeys,tok*mSlice,keyCount(tok));
+return mSize;
+}
+
+private:
+
+char const* mData{};
+std::size_t mSize{};
+};
+
+//------------------------------------------------------------------------------
+/**
+Keys or values of a file mapped read-only and shared by all Producers: text
+having one item per line, or binary, i.e. the magic JSNZCRP1, the item count
+and count+1 item offsets relative to the end of the offsets, as 64 bit words,
+followed by the items. Only the index of views gets built at load, numbers
+being checked to be JSON number literals on the way.
+*/
+struct Corpus : public std::enable_shared_from_this<Corpus>
+{
+static constexpr std::uint64_t MAGIC{0x315052435a4e534aull}; // "JSNZCRP1"
+
+static std::shared_ptr<Corpus const> load(
+    std::string const& path,
+    bool numbers)
+{
+std::shared_ptr<Corpus> corpus(new Corpus(path));
+corpus->index(numbers);
+if(corpus->mItems.empty())
+    throw std::runtime_error("empty corpus "+path);
+
+return corpus;
+}
+
+Pools::Views items() const
+{
+return Pools::views(shared_from_this(),mItems);
+}
+
+private:
+
+explicit Corpus(std::string const& path)
+    : mFile(path)
+    , mPath(path)
+{}
+
+static bool number(std::string_view s)
+{
+auto digits{[&s](std::size_t& i)
+    {
+    auto beg{i};
+    while(i<s.size() && s[i]>='0' && s[i]<='9')
+        ++i;
+    return i>beg;
+    }};
+std::size_t i{};
+if(i<s.size() && s[i]=='-')
+    ++i;
+if(i<s.size() && s[i]=='0')
+    ++i;
+else if(!digits(i))
+    return false;
+if(i<s.size() && s[i]=='.' && !digits(++i))
+    return false;
+if(i<s.size() && (s[i]=='e' || s[i]=='E'))
+    {
+    if(++i<s.size() && (s[i]=='+' || s[i]=='-'))
+        ++i;
+    if(!digits(i))
+        return false;
+    }
+return i==s.size();
+}
+
+void index(bool numbers)
+{
+auto data{mFile.data()};
+auto size{mFile.size()};
+std::uint64_t w[2]{};
+if(size>=sizeof w)
+    memcpy(w,data,sizeof w);
+if(w[0]==MAGIC)
+    {
+    auto count{w[1]};
+    auto offsets{2*sizeof(std::uint64_t)};
+    if(count>=size/sizeof(std::uint64_t)
+       || offsets+(count+1)*sizeof(std::uint64_t)>size)
+        throw std::runtime_error("bad offsets in "+mPath);
+
+    auto items{offsets+(count+1)*sizeof(std::uint64_t)};
+    std::uint64_t beg;
+    memcpy(&beg,data+offsets,sizeof beg);
+    mItems.reserve(count);
+    for(std::uint64_t i=1; i<=count; ++i)
+        {
+        std::uint64_t end;
+        memcpy(&end,data+offsets+i*sizeof end,sizeof end);
+        if(end<beg || end>size-items)
+            throw std::runtime_error("bad offsets in "+mPath);
+        mItems.emplace_back(data+items+beg,end-beg);
+        beg=end;
+        }
+    }
+else
+    for(std::size_t pos{}; pos<size;)
+        {
+        auto nl{static_cast<char const*>(memchr(data+pos,'\n',size-pos))};
+        auto end{nl ? static_cast<std::size_t>(nl-data) : size};
+        std::string_view line(data+pos,end-pos);
+        if(!line.empty() && line.back()=='\r')
+            line.remove_suffix(1);
+        if(!line.empty())
+            mItems.push_back(line);
+        pos=end+1;
+        }
+if(numbers)
+    for(auto const& i: mItems)
+        if(!number(i))
+            throw std::runtime_error("not a number in "+mPath+": "
+                +std::string(i.substr(0,32)));
+}
+
+MappedFile mFile;
+std::string mPath;
+Pools::V_SV mItems;
+};
+
+//------------------------------------------------------------------------------
+struct KeyGetterBase
+{
+using Token=std::size_t;
+
+virtual ~KeyGetterBase() = default;
+virtual std::size_t keyCount(Token) const = 0;
+virtual std::string get(Token) const = 0;
+
+virtual Token reg()
+{
+return 0;
+}
+
+virtual void activate(){}
+};
+
+using KeyGetterBasePtr = std::shared_ptr<KeyGetterBase>;
+
+//------------------------------------------------------------------------------
+/**
+Keys made of the names followed by count blocks of the names, i.e.
+names*(count+1) keys, materialized on demand from their index so that neither
+startup time nor memory depend on count. As the key table always had it, the
+first block repeats the plain names, and block n>1 gets the suffix _<n-1> in
+base 26 with digits a to z, i.e. _b ... _z, _ba ...
+*/
+struct KeyGetter : public KeyGetterBase
+{
+KeyGetter(Pools::Views names, bool raw, std::size_t count)
+    : mNames(std::move(names))
+    , mRaw(raw)
+    , mSize(mNames->size()*(count+1))
+    , mSlice(mSize)
+{}
+
+std::size_t keyCount(Token tok) const override
+{
+auto next{tok*mSlice+mSlice};
+auto tail{mSize-next};
+return tail>0 && tail<mSlice ? mSlice+tail : mSlice;
+}
+
+std::string get(Token tok) const override
+{
+std::string s;
+appendKey(s,index(tok,mt()));
+return s;
+}
+
+// Index of a key of the slice of tok, drawn by the random number r
+std::size_t index(Token tok, std::size_t r) const
+{
+return std::min(mSize-1,tok*mSlice+r%keyCount(tok));
 }
 
 Token reg() override
@@ -662,36 +1961,75 @@ return mToken++;
 
 virtual void activate()
 {
-mSlice=mKeys.size()/mToken;
+mSlice=mSize/mToken;
+}
+
+// Appends the key of index ix, quoted
+void appendKey(std::string& s, std::size_t ix) const
+{
+auto const& name{(*mNames)[ix%mNames->size()]};
+auto ordinal{ix/mNames->size()};
+s+='"';
+if(mRaw)
+    appendEscaped(s,name);
+else
+    s+=name;
+if(ordinal>1)
+    {
+    s+='_';
+    BaseN<1+'z'-'a'>::append(s,ordinal-1,'a');
+    }
+s+='"';
 }
 
 private:
 
-V_S mKeys;
+Pools::Views mNames;
+bool mRaw{};
+std::size_t mSize;
 Token mToken{};
 std::size_t mSlice;
 };
 
 //------------------------------------------------------------------------------
-template<typename T> struct SimpleValueGenerator
+// Leaves of one type, drawn from rendered literals, or raw strings
+struct SimpleValueGenerator
 {
-using DPtr=std::shared_ptr<std::deque<T>>;
-
-SimpleValueGenerator(DPtr&& values)
-    : mValues(values)
+SimpleValueGenerator(Part::Type type, Pools::Views literals, bool raw)
+    : mType(type)
+    , mLiterals(std::move(literals))
+    , mRaw(raw)
 {}
 
 PartPtr get() const
 {
-if(!mValues || mValues->empty())
+if(mLiterals->empty())
     return PartPtr();
 
-return std::make_shared<Part>((*mValues)[mt()%mValues->size()]);
+std::string s;
+appendTo(s,mt());
+return std::make_shared<Part>(mType,Key(),Value(std::move(s)));
+}
+
+// Appends the literal drawn by the random number r
+void appendTo(std::string& out, std::size_t r) const
+{
+auto const& literal{(*mLiterals)[r%mLiterals->size()]};
+if(!mRaw)
+    {
+    out+=literal;
+    return;
+    }
+out+='"';
+appendEscaped(out,literal);
+out+='"';
 }
 
 private:
 
-DPtr mValues;
+Part::Type mType;
+Pools::Views mLiterals;
+bool mRaw{};
 };
 
 //------------------------------------------------------------------------------
@@ -704,7 +2042,7 @@ virtual PartPtr get(MuxParts& queue)=0;
 using FactoryBasePtr=std::shared_ptr<FactoryBase>;
 
 //------------------------------------------------------------------------------
-template<Part::SimpleType N> struct SimpleKvPairFactory
+template<Part::SimpleType N> struct SimpleKvPairFactory final
     : public FactoryBase
 {
 using Ptr=std::shared_ptr<SimpleKvPairFactory>;
@@ -728,7 +2066,7 @@ if(!part)
 queue.pop_front();
 auto keys{mpKeys.lock()};
 if(keys && part->match(N) && !part->key() && part->value())
-    return std::make_shared<Part>(Part::T2T(N),keys->get(mTok),part->value());
+    return std::make_shared<Part>(*part,keys->get(mTok));
 
 return PartPtr();
 }
@@ -759,9 +2097,40 @@ if(keys)
     mTok=keys->reg();
 }
 
-virtual bool match(PartPtr p) const=0;
+bool uniqueKey(std::string const& rhs) const
+{
+for(auto const& i: mSubs)
+    if(i && i->key() && *(i->key())==rhs)
+        return false;
+
+return true;
+}
+
+// Hands over the Parts collected so far, for recycling
+D_PartPtr drain()
+{
+D_PartPtr subs;
+subs.swap(mSubs);
+mHeldBytes=0;
+return subs;
+}
 
-PartPtr get(MuxParts& queue) override
+void restock(D_PartPtr const& subs)
+{
+mSubs.insert(mSubs.end(),subs.begin(),subs.end());
+for(auto const& i: subs)
+    mHeldBytes+=i ? i->size() : 0;
+}
+
+// Serialized size of the Parts collected so far, read by any thread
+std::size_t heldBytes() const
+{
+return mHeldBytes;
+}
+
+protected:
+
+template<typename D> PartPtr assemble(MuxParts& queue, D const& self)
 {
 if(mSubs.size()<mExpectedLen)
     {
@@ -769,12 +2138,13 @@ if(mSubs.size()<mExpectedLen)
     if(!queue.empty())
         p=queue.front();
 
-    if(match(p))
+    if(self.match(p))
         {
+        queue.pop_front();
         if(mPartType==Part::Type::ARRAY)
             p->setKey(Key());
+        mHeldBytes+=p ? p->size() : 0;
         mSubs.push_back(p);
-        queue.pop_front();
         }
     if(mSubs.size()<mExpectedLen)
         return PartPtr();
@@ -786,23 +2156,18 @@ if(!keys)
 auto part{std::make_shared<Part>(mPartType,mSubs,keys->get(mTok))};
 mExpectedLen=mMaxLen<=mMinLen ? mMinLen : (mt()%(1+mMaxLen-mMinLen)+mMinLen);
 if(mAutoClear)
+    {
     mSubs.clear();
+    mHeldBytes=0;
+    }
 
 return part;
 }
 
-bool uniqueKey(std::string const& rhs) const
-{
-for(auto const& i: mSubs)
-    if(i && i->key() && *(i->key())==rhs)
-        return false;
-
-return true;
-}
-
 private:
 
 D_PartPtr mSubs;
+std::atomic<std::size_t> mHeldBytes{};
 std::size_t mMinLen;
 std::size_t mMaxLen;
 std::size_t mExpectedLen;
@@ -813,8 +2178,20 @@ KeyGetter::Token mTok{};
 };
 
 //------------------------------------------------------------------------------
-template<Part::SimpleType N> struct SimpleArrayFactory
-    : public ContainerFactoryBase
+// Binds the matching criteria of D statically, D being a final class
+template<typename D> struct ContainerFactory : public ContainerFactoryBase
+{
+using ContainerFactoryBase::ContainerFactoryBase;
+
+PartPtr get(MuxParts& queue) override
+{
+return assemble(queue,static_cast<D const&>(*this));
+}
+};
+
+//------------------------------------------------------------------------------
+template<Part::SimpleType N> struct SimpleArrayFactory final
+    : public ContainerFactory<SimpleArrayFactory<N>>
 {
 using Ptr=std::shared_ptr<SimpleArrayFactory>;
 
@@ -823,18 +2200,19 @@ SimpleArrayFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
+    : ContainerFactory<SimpleArrayFactory>(
+        minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p && p->match(N) && !p->key() && p->value();
 }
 };
 
 //------------------------------------------------------------------------------
-template<Part::SimpleType N> struct SimpleObjectFactory
-    : public ContainerFactoryBase
+template<Part::SimpleType N> struct SimpleObjectFactory final
+    : public ContainerFactory<SimpleObjectFactory<N>>
 {
 using Ptr=std::shared_ptr<SimpleObjectFactory>;
 
@@ -843,17 +2221,20 @@ SimpleObjectFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
+    : ContainerFactory<SimpleObjectFactory>(
+        minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
-return p && p->match(N) && p->key() && p->value() && uniqueKey(*(p->key()));
+return p && p->match(N) && p->key() && p->value()
+    && this->uniqueKey(*(p->key()));
 }
 };
 
 //------------------------------------------------------------------------------
-struct ObjectArrayFactory : public ContainerFactoryBase
+struct ObjectArrayFactory final
+    : public ContainerFactory<ObjectArrayFactory>
 {
 using Ptr=std::shared_ptr<ObjectArrayFactory>;
 
@@ -862,17 +2243,19 @@ ObjectArrayFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
+    : ContainerFactory<ObjectArrayFactory>(
+        minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p && p->type()==Part::Type::OBJECT;
 }
 };
 
 //------------------------------------------------------------------------------
-struct ArrayArrayFactory : public ContainerFactoryBase
+struct ArrayArrayFactory final
+    : public ContainerFactory<ArrayArrayFactory>
 {
 using Ptr=std::shared_ptr<ArrayArrayFactory>;
 
@@ -881,10 +2264,11 @@ ArrayArrayFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
+    : ContainerFactory<ArrayArrayFactory>(
+        minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p && p->type()==Part::Type::ARRAY && p->subs()
    && (p->subs()->empty()
@@ -894,7 +2278,8 @@ return p && p->type()==Part::Type::ARRAY && p->subs()
 };
 
 //------------------------------------------------------------------------------
-struct MixedArrayFactory : public ContainerFactoryBase
+struct MixedArrayFactory final
+    : public ContainerFactory<MixedArrayFactory>
 {
 using Ptr=std::shared_ptr<MixedArrayFactory>;
 
@@ -903,17 +2288,19 @@ MixedArrayFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
+    : ContainerFactory<MixedArrayFactory>(
+        minLen,maxLen,autoClear,Part::Type::ARRAY,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p!=nullptr;
 }
 };
 
 //------------------------------------------------------------------------------
-struct ArrayObjectFactory : public ContainerFactoryBase
+struct ArrayObjectFactory final
+    : public ContainerFactory<ArrayObjectFactory>
 {
 using Ptr=std::shared_ptr<ArrayObjectFactory>;
 
@@ -922,17 +2309,19 @@ ArrayObjectFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
+    : ContainerFactory<ArrayObjectFactory>(
+        minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p && p->key()  && uniqueKey(*(p->key())) && p->type()==Part::Type::ARRAY;
 }
 };
 
 //------------------------------------------------------------------------------
-struct ObjectObjectFactory : public ContainerFactoryBase
+struct ObjectObjectFactory final
+    : public ContainerFactory<ObjectObjectFactory>
 {
 using Ptr=std::shared_ptr<ObjectObjectFactory>;
 
@@ -941,17 +2330,19 @@ ObjectObjectFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
+    : ContainerFactory<ObjectObjectFactory>(
+        minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p && p->key() && uniqueKey(*(p->key())) && p->type()==Part::Type::OBJECT;
 }
 };
 
 //------------------------------------------------------------------------------
-struct MixedObjectFactory : public ContainerFactoryBase
+struct MixedObjectFactory final
+    : public ContainerFactory<MixedObjectFactory>
 {
 using Ptr=std::shared_ptr<MixedObjectFactory>;
 
@@ -960,18 +2351,134 @@ MixedObjectFactory(
     std::size_t maxLen,
     bool autoClear,
     KeyGetterBasePtr keys)
-    : ContainerFactoryBase(minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
+    : ContainerFactory<MixedObjectFactory>(
+        minLen,maxLen,autoClear,Part::Type::OBJECT,keys)
 {}
 
-bool match(PartPtr p) const override
+bool match(PartPtr p) const
 {
 return p && p->key() && uniqueKey(*(p->key()));
 }
 };
 
+//------------------------------------------------------------------------------
+/**
+Leftovers of finished Producers, i.e. their unclaimed Products, queued Parts
+and the Parts buffered in container factories, shelved by Producer signature
+to seed the next Producer of the same shape. Stock older than the max age is
+dropped, so a long lived process keeps its over-production as a cache
+without serving stale documents.
+*/
+struct Inventory
+{
+struct Stock
+{
+std::size_t size() const
+{
+auto n{products.size()+parts.size()};
+for(auto const& i: buffers)
+    n+=i.size();
+return n;
+}
+
+// Serialized size of all the Parts
+std::size_t bytes() const
+{
+auto sum{[](D_PartPtr const& parts)
+    {
+    std::size_t n{};
+    for(auto const& i: parts)
+        n+=i ? i->size() : 0;
+    return n;
+    }};
+auto n{sum(products)+sum(parts)};
+for(auto const& i: buffers)
+    n+=sum(i);
+return n;
+}
+
+D_PartPtr products;
+D_PartPtr parts;
+std::array<D_PartPtr,CT_COUNT> buffers;
+std::chrono::steady_clock::time_point stamp{
+    std::chrono::steady_clock::now()};
+};
+
+static Inventory& instance()
+{
+static Inventory inventory;
+return inventory;
+}
+
+void enable(double maxAge)
+{
+mMaxAge=std::chrono::duration<double>(maxAge);
+}
+
+bool enabled() const
+{
+return mMaxAge.count()>0;
+}
+
+// Keeps the shelf of the signature within budget bytes, if given, by expiring
+// its oldest stock
+void deposit(std::string const& signature, Stock&& stock, std::size_t budget=0)
+{
+g_metrics.inventoryDeposited+=stock.size();
+std::lock_guard lock{mMux};
+auto& shelf{mShelves[signature]};
+shelf.push_back(std::move(stock));
+if(!budget)
+    return;
+
+std::size_t bytes{};
+for(auto const& i: shelf)
+    bytes+=i.bytes();
+while(shelf.size()>1 && bytes>budget)
+    {
+    bytes-=shelf.front().bytes();
+    g_metrics.inventoryExpired+=shelf.front().size();
+    shelf.pop_front();
+    }
+}
+
+// Takes the freshest stock of the signature, after expiring the aged ones
+std::optional<Stock> withdraw(std::string const& signature)
+{
+std::lock_guard lock{mMux};
+auto& shelf{mShelves[signature]};
+auto now{std::chrono::steady_clock::now()};
+while(!shelf.empty() && now-shelf.front().stamp>mMaxAge)
+    {
+    g_metrics.inventoryExpired+=shelf.front().size();
+    shelf.pop_front();
+    }
+if(shelf.empty())
+    return std::nullopt;
+
+auto stock{std::move(shelf.back())};
+shelf.pop_back();
+g_metrics.inventoryWithdrawn+=stock.size();
+return stock;
+}
+
+private:
+
+std::mutex mMux;
+std::map<std::string,std::deque<Stock>> mShelves;
+std::chrono::duration<double> mMaxAge{};
+};
+
 //------------------------------------------------------------------------------
 struct ProducerParams
 {
+// Assembly line, or direct sampling of the same shapes
+enum class Engine
+{
+ QUEUE
+,DIRECT
+};
+
 struct ConsumerParams
 {
 std::size_t min{};
@@ -1035,432 +2542,3267 @@ V_S const& keys() const
 return mKeys;
 }
 
+/**
+Keys and value literals of the Producer: those of the Snapshot this was
+loaded from, else rendered here from keys() and the value groups, the key
+names or the value groups of a type being replaced by the corpora given.
+*/
+Pools pools() const
+{
+auto pools{mPools ? *mPools : render()};
+if(mKeyCorpus)
+    {
+    pools.keys=mKeyCorpus->items();
+    pools.rawKeys=true;
+    }
+for(std::size_t t=0; t<mValueCorpora.size(); ++t)
+    if(!mValueCorpora[t].empty())
+        {
+        pools.literals[t].clear();
+        for(auto const& i: mValueCorpora[t])
+            pools.literals[t].push_back(i->items());
+        }
+if(!mValueCorpora[static_cast<std::size_t>(Part::SimpleType::STRING)].empty())
+    pools.rawStrings=true;
+return pools;
+}
+
+// Corpora replacing the key names, or the value groups of their type
+void setKeyCorpus(std::shared_ptr<Corpus const> rhs)
+{
+mKeyCorpus=std::move(rhs);
+}
+
+void addValueCorpus(Part::SimpleType type, std::shared_ptr<Corpus const> rhs)
+{
+mValueCorpora[static_cast<std::size_t>(type)].push_back(std::move(rhs));
+}
+
+void setPools(Pools const& rhs)
+{
+mPools=rhs;
+}
+
 std::size_t keyMultiplier() const
 {
 return mMultiplier;
 }
 
+// Identifies the shape of the Products, for recycling them
+std::string signature() const
+{
+std::stringstream ss;
+ss << mMultiplier;
+if(mEngine==Engine::DIRECT)
+    ss << "/direct";
+if(mAdaptive)
+    ss << "/adaptive";
+if(!mPreset.empty())
+    ss << '/' << mPreset;
+else
+    for(auto const& [k,v]: mCons)
+        ss << '/' << static_cast<int>(k) << ',' << v.min << ',' << v.max
+           << ',' << v.recirc << ',' << v.weigth;
+return ss.str();
+}
+
 void setConsumerParams(M_ConsumerParams rhs)
 {
 mCons.swap(rhs);
 }
 
+M_ConsumerParams const& consumerParams() const
+{
+return mCons;
+}
+
+// Individual overrides leave the preset, and thus its static pipeline
 void setConsumerParam(CT ct, ConsumerParams const& cp)
 {
 mCons[ct]=cp;
+mPreset.clear();
 }
 
-private:
+void setPreset(std::string const& rhs)
+{
+mPreset=rhs;
+}
 
-V_S mKeys;
-std::size_t mMultiplier{};
-D_D_I mInts;
-D_D_D mDoubles;
-D_D_S mStrings;
-M_ConsumerParams mCons;
-};
+// Limits of the work queue in Parts and of the queued Parts and Products
+// in bytes, 0 meaning unlimited
+void setQueueCapacity(std::size_t rhs)
+{
+mQueueCapacity=rhs;
+}
 
-//------------------------------------------------------------------------------
-struct Producer
+std::size_t queueCapacity() const
 {
-enum IX
+return mQueueCapacity;
+}
+
+void setMemoryBudget(std::size_t rhs)
 {
- FACTORY
-,PERCENTAGE
-,WEIGTH
-};
+mMemoryBudget=rhs;
+}
 
-public:
+std::size_t memoryBudget() const
+{
+return mMemoryBudget;
+}
 
-Producer(ProducerParams par)
+// Warm stock watermarks, in values of each type held in finished Products,
+// 0 meaning no stock kept
+void setStock(std::size_t low, std::size_t high)
 {
-for(auto const& i: par.ints())
-    mValueFIs.push_back(D_I_Ptr{new D_I{i}});
+mStockLow=low;
+mStockHigh=std::max(low,high);
+}
 
-for(auto const& i: par.doubles())
-    mValueFDs.push_back(D_D_Ptr{new D_D{i}});
+std::size_t stockLow() const
+{
+return mStockLow;
+}
 
-for(auto const& i: par.strings())
-    mValueFSs.push_back(D_S_Ptr{new D_S{i}});
+std::size_t stockHigh() const
+{
+return mStockHigh;
+}
 
-mKeyGetter=std::make_shared<KeyGetter>(par.keys(),par.keyMultiplier());
+void setEngine(Engine rhs)
+{
+mEngine=rhs;
+}
 
-init(
-     tie2(mKvpFI,mKeyGetter)
-    ,tie2(mKvpFD,mKeyGetter)
-    ,tie2(mKvpFS,mKeyGetter)
-    ,tie5(mArrayFI,par[CT::AI].min,par[CT::AI].max,true,mKeyGetter)
-    ,tie5(mArrayFD,par[CT::AD].min,par[CT::AD].max,true,mKeyGetter)
-    ,tie5(mArrayFS,par[CT::AS].min,par[CT::AS].max,true,mKeyGetter)
-    ,tie5(mObjectFI,par[CT::OI].min,par[CT::OI].max,true,mKeyGetter)
-    ,tie5(mObjectFD,par[CT::OD].min,par[CT::OD].max,true,mKeyGetter)
-    ,tie5(mObjectFS,par[CT::OS].min,par[CT::OS].max,true,mKeyGetter)
-    ,tie5(mObjArray,par[CT::AO].min,par[CT::AO].max,true,mKeyGetter)
-    ,tie5(mArrayArray,par[CT::AA].min,par[CT::AA].max,true,mKeyGetter)
-    ,tie5(mMixedArray,par[CT::AM].min,par[CT::AM].max,true,mKeyGetter)
-    ,tie5(mArrayObj,par[CT::OA].min,par[CT::OA].max,true,mKeyGetter)
-    ,tie5(mObjObj,par[CT::OO].min,par[CT::OO].max,true,mKeyGetter)
-    ,tie5(mMixedObj,par[CT::OM].min,par[CT::OM].max,true,mKeyGetter));
+Engine engine() const
+{
+return mEngine;
+}
 
-mKeyGetter->activate();
-
-mConsumers={
-     {mKvpFI,par[CT::KI].recirc,par[CT::KI].weigth}
-    ,{mKvpFD,par[CT::KD].recirc,par[CT::KD].weigth}
-    ,{mKvpFS,par[CT::KS].recirc,par[CT::KS].weigth}
-
-    ,{mArrayFI,par[CT::AI].recirc,par[CT::AI].weigth}
-    ,{mArrayFD,par[CT::AD].recirc,par[CT::AD].weigth}
-    ,{mArrayFS,par[CT::AS].recirc,par[CT::AS].weigth}
-
-    ,{mObjectFI,par[CT::OI].recirc,par[CT::OI].weigth}
-    ,{mObjectFD,par[CT::OD].recirc,par[CT::OD].weigth}
-    ,{mObjectFS,par[CT::OS].recirc,par[CT::OS].weigth}
-
-    ,{mObjArray,par[CT::AO].recirc,par[CT::AO].weigth}
-    ,{mArrayArray,par[CT::AA].recirc,par[CT::AA].weigth}
-    ,{mMixedArray,par[CT::AM].recirc,par[CT::AM].weigth}
-
-    ,{mArrayObj,par[CT::OA].recirc,par[CT::OA].weigth}
-    ,{mObjObj,par[CT::OO].recirc,par[CT::OO].weigth}
-    ,{mMixedObj,par[CT::OM].recirc,par[CT::OM].weigth}
-    };
+// Online tuning of recirculation and weights, see Producer::Controller
+void setAdaptive(bool rhs)
+{
+mAdaptive=rhs;
 }
 
-void order(int ints, int doubles, int strings)
+bool adaptive() const
 {
-if(ints>0)
-    {
-    auto ix{mt()%mValueFIs.size()};
-    for(; ints>=0; --ints)
-        mParts.push_back(mValueFIs[ix].get());
-    }
-if(doubles>0)
-    {
-    auto ix{mt()%mValueFDs.size()};
-    for(; doubles>=0; --doubles)
-        mParts.push_back(mValueFDs[ix].get());
-    }
-if(strings>0)
-    {
-    auto ix{mt()%mValueFSs.size()};
-    for(; strings>=0; --strings)
-        mParts.push_back(mValueFSs[ix].get());
-    }
+return mAdaptive;
 }
 
-void recirculate(PartPtr p)
+// Seed of the random draws of the Producer, random when unset
+void setSeed(std::optional<std::uint32_t> rhs)
 {
-if(p)
-    mParts.push_back(p);
+mSeed=rhs;
 }
 
-void done()
+std::optional<std::uint32_t> seed() const
 {
-mDone=true;
+return mSeed;
 }
 
-PartPtr get()
+// Takes over the Producer knobs which are not part of a preset
+void setRuntime(ProducerParams const& rhs)
 {
-return mProducts.get();
+mMultiplier=rhs.mMultiplier;
+mEngine=rhs.mEngine;
+mAdaptive=rhs.mAdaptive;
+mSeed=rhs.mSeed;
+mQueueCapacity=rhs.mQueueCapacity;
+mMemoryBudget=rhs.mMemoryBudget;
+mStockLow=rhs.mStockLow;
+mStockHigh=rhs.mStockHigh;
+if(rhs.mKeyCorpus)
+    mKeyCorpus=rhs.mKeyCorpus;
+for(std::size_t t=0; t<mValueCorpora.size(); ++t)
+    if(!rhs.mValueCorpora[t].empty())
+        mValueCorpora[t]=rhs.mValueCorpora[t];
 }
 
-std::string produce()
+std::string const& preset() const
 {
-std::vector<std::size_t> key,key2;
-for(std::size_t i=0; i<mConsumers.size(); ++i)
-    for(std::size_t j=0; j<std::get<IX::WEIGTH>(mConsumers[i]); ++j)
-        key2.push_back(i);
+return mPreset;
+}
 
-key=key2;
-std::size_t madeProducts{};
-std::map<Part::Type,std::size_t> madeTypes;
-while(!mDone)
-    {
-    if(mParts.empty())
-        {
-        std::unique_lock lock{muxCvProd};
-        cvProd.wait(lock,[&mParts=mParts,&mDone=mDone]
-            {
-            return !mParts.empty() || mDone;
-            });
-        continue;
-        }
-    auto candidate{mParts.front()->serial()};
-    while(!key.empty())
-        {
-        auto ix{mt() % key.size()};
-        auto ixx{key[ix]};
-        key.erase(key.begin()+ix);
-        auto& consumer{mConsumers[ixx]};
-        auto part{std::get<IX::FACTORY>(consumer)->get(mParts)};
-        if(part)
-            {
-            if(100-std::get<IX::PERCENTAGE>(consumer) < mt()%100)
-                mParts.push_back(part);
-            else
-                {
-                ++madeTypes[part->type()];
-                mProducts.push_back(part);
-                    {
-                    std::lock_guard lock{muxCvAsse};
-                    cvAsse.notify_all();
-                    }
-                if(!(++madeProducts % 100))
-                    {
-                    DisNDat<> c("",", ");
-                    std::stringstream ss;
-                    ss << "Products created: " << madeProducts << " (";
-                    for(auto const& [k,v]: madeTypes)
-                        ss << c << k << ": " << v;
+private:
 
-                    ss << "); queue size: " << mParts.size();
-                    LOG(ss.str());
-                    }
-                }
-            }
-        }
-    key=key2;
-    if(mParts.empty())
-        {
-        std::lock_guard lock{muxCvAsse};
-        cvAsse.notify_all();
-        }
-    else if(candidate==mParts.front()->serial())
+Pools render() const
+{
+struct Owned
+{
+V_S keys;
+std::array<std::vector<V_S>,3> literals;
+Pools::V_SV keyViews;
+std::array<std::vector<Pools::V_SV>,3> literalViews;
+};
+auto owned{std::make_shared<Owned>()};
+for(auto const& i: mKeys)
+    appendEscaped(owned->keys.emplace_back(),i);
+auto render{[](auto const& groups, std::vector<V_S>& literals)
+    {
+    for(auto const& i: groups)
         {
-        ++mMisses[candidate];
-        if(mMisses[candidate]>2)
-            {
-            LOG("NOT CONSUMED: " << *mParts.front());
-            mProducts.push_back(mParts.front());
-            mParts.pop_front();
-            mMisses.erase(candidate);
-            if(mParts.empty())
-                {
-                std::lock_guard lock{muxCvAsse};
-                cvAsse.notify_all();
-                }
-            }
-        else
-            {
-            mParts.push_back(mParts.front());
-            mParts.pop_front();
-            }
+        auto& group{literals.emplace_back()};
+        for(auto const& v: i)
+            group.push_back(conv(v));
         }
-    }
-LOG("Total products created: " << madeProducts
-    << "\nLeftover queue size: " << mParts.size()
-    << "\nLeftover products: ");
-DisNDat<> c("",",");
-std::stringstream ss;
-while(!mProducts.empty())
+    }};
+render(mInts,owned->literals[0]);
+render(mDoubles,owned->literals[1]);
+render(mStrings,owned->literals[2]);
+
+Pools pools;
+owned->keyViews.assign(owned->keys.begin(),owned->keys.end());
+pools.keys=Pools::views(owned,owned->keyViews);
+for(std::size_t t=0; t<owned->literals.size(); ++t)
     {
-    ss << c << *mProducts.front();
-    mProducts.pop_front();
+    for(auto const& i: owned->literals[t])
+        owned->literalViews[t].emplace_back(i.begin(),i.end());
+    for(auto const& i: owned->literalViews[t])
+        pools.literals[t].push_back(Pools::views(owned,i));
     }
-return ss.str();
+return pools;
 }
 
-private:
-
-std::deque<SimpleValueGenerator<int>> mValueFIs;
-std::deque<SimpleValueGenerator<double>> mValueFDs;
-std::deque<SimpleValueGenerator<std::string>> mValueFSs;
+std::string mPreset;
+Engine mEngine{};
+bool mAdaptive{};
+std::optional<std::uint32_t> mSeed;
+std::size_t mQueueCapacity{};
+std::size_t mMemoryBudget{};
+std::size_t mStockLow{};
+std::size_t mStockHigh{};
+V_S mKeys;
+std::size_t mMultiplier{};
+D_D_I mInts;
+D_D_D mDoubles;
+D_D_S mStrings;
+std::optional<Pools> mPools;
+std::shared_ptr<Corpus const> mKeyCorpus;
+std::array<std::vector<std::shared_ptr<Corpus const>>,3> mValueCorpora;
+M_ConsumerParams mCons;
+};
 
-SimpleKvPairFactory<Part::SimpleType::INT>::Ptr mKvpFI;
-SimpleKvPairFactory<Part::SimpleType::DOUBLE>::Ptr mKvpFD;
-SimpleKvPairFactory<Part::SimpleType::STRING>::Ptr mKvpFS;
+//------------------------------------------------------------------------------
+// Predefined consumer parameters, indexed by CT
+using PresetTable=std::array<ProducerParams::ConsumerParams,15>;
 
-SimpleArrayFactory<Part::SimpleType::INT>::Ptr mArrayFI;
-SimpleArrayFactory<Part::SimpleType::DOUBLE>::Ptr mArrayFD;
-SimpleArrayFactory<Part::SimpleType::STRING>::Ptr mArrayFS;
+struct DefaultPreset
+{
+static constexpr char const* NAME{"default"};
+static constexpr PresetTable TABLE{{
+     {1,2,50,1} // KI
+    ,{1,2,50,1} // KD
+    ,{1,2,50,1} // KS
+    ,{1,2,50,1} // AI
+    ,{1,2,50,1} // AD
+    ,{1,2,50,1} // AS
+    ,{1,2,50,1} // AA
+    ,{1,2,50,1} // AO
+    ,{1,2,50,1} // AM
+    ,{1,2,50,1} // OI
+    ,{1,2,50,1} // OD
+    ,{1,2,50,1} // OS
+    ,{1,2,50,1} // OA
+    ,{1,2,50,1} // OO
+    ,{1,2,50,1} // OM
+    }};
+};
 
-SimpleObjectFactory<Part::SimpleType::INT>::Ptr mObjectFI;
-SimpleObjectFactory<Part::SimpleType::DOUBLE>::Ptr mObjectFD;
-SimpleObjectFactory<Part::SimpleType::STRING>::Ptr mObjectFS;
+struct GodboltPreset
+{
+static constexpr char const* NAME{"godbolt"};
+static constexpr PresetTable TABLE{{
+     {0,0,90,1} // KI
+    ,{0,0,90,1} // KD
+    ,{0,0,90,1} // KS
+    ,{4,12,80,1} // AI
+    ,{3,11,80,1} // AD
+    ,{2,10,80,1} // AS
+    ,{3,5,40,1} // AA
+    ,{2,6,40,1} // AO
+    ,{2,4,40,1} // AM
+    ,{3,5,40,1} // OI
+    ,{4,5,40,1} // OD
+    ,{2,5,40,1} // OS
+    ,{4,8,30,1} // OA
+    ,{3,7,30,1} // OO
+    ,{2,6,30,1} // OM
+    }};
+};
 
-ObjectArrayFactory::Ptr mObjArray;
-ArrayArrayFactory::Ptr mArrayArray;
-ArrayArrayFactory::Ptr mMixedArray;
+struct ComplexPreset
+{
+static constexpr char const* NAME{"complex"};
+static constexpr PresetTable TABLE{{
+     {0,0,90,1} // KI
+    ,{0,0,90,1} // KD
+    ,{0,0,90,1} // KS
+    ,{4,12,80,1} // AI
+    ,{3,11,80,1} // AD
+    ,{2,10,80,1} // AS
+    ,{3,5,80,1} // AA
+    ,{2,6,80,1} // AO
+    ,{2,4,80,1} // AM
+    ,{3,5,80,1} // OI
+    ,{4,5,80,1} // OD
+    ,{2,5,80,1} // OS
+    ,{4,8,90,1} // OA
+    ,{3,7,90,1} // OO
+    ,{2,6,90,1} // OM
+    }};
+};
 
-ArrayObjectFactory::Ptr mArrayObj;
-ObjectObjectFactory::Ptr mObjObj;
-ObjectObjectFactory::Ptr mMixedObj;
+using Presets=std::tuple<DefaultPreset,GodboltPreset,ComplexPreset>;
 
-// Tuple items:                   factory       ,recirc% ,weigth*
-using ConsumerProducer=std::tuple<FactoryBasePtr,unsigned,unsigned>;
-std::vector<ConsumerProducer> mConsumers;
+template<typename P> constexpr std::size_t presetWeigth()
+{
+std::size_t n{};
+for(auto const& i: P::TABLE)
+    n+=i.weigth;
+return n;
+}
 
-MuxParts mParts;
-MuxParts mProducts;
-std::map<Serial,int> mMisses;
-KeyGetterBasePtr mKeyGetter;
-std::atomic<bool> mDone{};
-};
+// Consumer indexes repeated by weigth, the static counterpart of the runtime
+// built vector
+template<typename P> constexpr std::array<std::size_t,presetWeigth<P>()>
+    presetKeys()
+{
+std::array<std::size_t,presetWeigth<P>()> keys{};
+std::size_t n{};
+for(std::size_t i=0; i<P::TABLE.size(); ++i)
+    for(std::size_t j=0; j<P::TABLE[i].weigth; ++j)
+        keys[n++]=i;
+return keys;
+}
 
 //------------------------------------------------------------------------------
-struct Assembly
+// Request tuple items: int values, double values, string values, bytes
+using Counts=std::tuple<int,int,int,std::size_t>;
+using V_Counts=std::vector<Counts>;
+
+// Failure of a document whose keys ran out before it got complete
+std::runtime_error keySpaceExhausted(
+    std::size_t bytes,
+    std::size_t ints,
+    std::size_t doubles,
+    std::size_t strings)
 {
-Assembly(
-    std::shared_ptr<Producer> prod,
-    int ints,
-    int doubles,
-    int strings)
-    : mProd(prod)
-    , mInts(ints)
-    , mDoubles(doubles)
-    , mStrings(strings)
-{}
+return std::runtime_error("Key space exhausted at "+std::to_string(bytes)
+    +" bytes and values "+std::to_string(ints)+','+std::to_string(doubles)
+    +','+std::to_string(strings)+", use a larger -s");
+}
 
-std::string run()
+//------------------------------------------------------------------------------
+// Sets of Part sources of the DirectEngine: leaves of the 3 types, then the
+// products of each CT
+constexpr unsigned leaves(std::size_t type)
 {
-auto beg{std::chrono::steady_clock::now()};
-mProd->order(mInts,mDoubles,mStrings);
+return 1u<<type;
+}
+
+constexpr unsigned products(std::initializer_list<CT> cts)
 {
-std::lock_guard lock{muxCvProd};
-cvProd.notify_one();
+unsigned set{};
+for(auto ct: cts)
+    set|=1u<<(3+static_cast<std::size_t>(ct));
+return set;
 }
+
+//------------------------------------------------------------------------------
+/**
+Express alternative of the assembly line (-e direct), sampling the shapes it
+would produce recursively, right into the output. The weights come from the
+steady state flows of the line, solved once per set of leaf types: each Part
+at the queue head goes to one of the factories taking it, by weigth, where K*
+factories take (and drop) any Part; containers take len Parts to build one,
+len being drawn from [min,max], and recirculate it with (recirc-1)%. Top level
+members are then drawn by the shipping rates, and container members by what
+flows into the container. As in the Producer, AM takes arrays like AA and OM
+objects like OO. Past MAX_DEPTH members come from the shallowest sources.
+*/
+struct DirectEngine
+{
+static constexpr std::size_t MAX_DEPTH{16};
+static constexpr std::size_t CHUNK{64u<<10};
+
+explicit DirectEngine(ProducerParams par)
 {
-std::unique_lock lock{muxCvAsse};
-cvAsse.wait(lock);
+auto pools{par.pools()};
+for(std::size_t t=0; t<mLeaves.size(); ++t)
+    for(auto const& i: pools.literals[t])
+        mLeaves[t].emplace_back(Part::T2T(static_cast<Part::SimpleType>(t)),i
+            ,pools.rawStrings
+                && t==static_cast<std::size_t>(Part::SimpleType::STRING));
+mKeys=std::make_shared<KeyGetter>(
+    pools.keys,pools.rawKeys,par.keyMultiplier());
+for(std::size_t ct=0; ct<CT_COUNT; ++ct)
+    {
+    mTokens[ct]=mKeys->reg();
+    mCons[ct]=par[static_cast<CT>(ct)];
+    }
+mKeys->activate();
+for(std::size_t types=1; types<mFlows.size(); ++types)
+    flows(types);
+mSeed=par.seed();
 }
-int iCount{};
-int dCount{};
-int sCount{};
-std::stringstream ss;
-ss << '{';
-DisNDat<> c("",",");
-std::map<std::string,Part::Type> keys;
-while((iCount<mInts || dCount<mDoubles || sCount<mStrings))
+
+/**
+Appends one document of at least the requested values and bytes, handing
+out to flush at member boundaries once it holds CHUNK bytes, and returns the
+values of each type. Members have leaves of the types still lacking, of all
+of them while bytes are. Seeded, the n-th document requested draws from the
+seed and n, whichever thread runs it. Keys are drawn as by the Producer; when
+a drawn one is taken, as the Assembly would recirculate the member, the next
+free key of the slice in order is used instead. Throws std::runtime_error when
+the keys run out before the document is complete.
+*/
+template<typename F> std::array<std::size_t,3> document(
+    std::string& out,
+    Counts const& counts,
+    F&& flush) const
+{
+if(mSeed)
     {
-    auto prod{mProd->get()};
-    if(!prod)
-        {
-        mProd->order(mInts-iCount>0 ? 1:0,
-            mDoubles-dCount>0 ? 1:0,mStrings-sCount>0 ? 1:0);
+    std::seed_seq seq{*mSeed,static_cast<std::uint32_t>(mDocuments++)};
+    mt.seed(seq);
+    }
+auto [ints,doubles,strings,bytes]{counts};
+std::array<std::size_t,3> values{};
+std::unordered_set<std::string> keys;
+std::array<std::size_t,CT_COUNT> scanned{};
+std::array<bool,CT_COUNT> exhausted{};
+std::string key;
+std::size_t flushed{};
+auto lacking{[&]
+    {
+    std::size_t types{
+         (values[0]<static_cast<std::size_t>(std::max(ints,0)) ? 1u : 0u)
+        |(values[1]<static_cast<std::size_t>(std::max(doubles,0)) ? 2u : 0u)
+        |(values[2]<static_cast<std::size_t>(std::max(strings,0)) ? 4u : 0u)};
+    return flushed+out.size()<bytes ? 7 : types;
+    }};
+out+='{';
+for(std::size_t types{lacking()}; types; types=lacking())
+    {
+    auto const& flows{mFlows[types]};
+    auto shipped{flows.shipped};
+    for(std::size_t ct=0; ct<CT_COUNT; ++ct)
+        if(exhausted[ct])
+            shipped[ct]=0;
+    auto ct{draw(shipped)};
+    if(ct==CT_COUNT)
         {
-        std::lock_guard lock{muxCvProd};
-        cvProd.notify_one();
-        }
-        std::unique_lock lock{muxCvAsse};
-        cvAsse.wait(lock);
-        continue;
+        if(shipped==flows.shipped)
+            break;
+        throw keySpaceExhausted(
+            flushed+out.size(),values[0],values[1],values[2]);
         }
-    bool recirc{};
-    if(!prod->key())
-        recirc=true;
-    else
+    if(!freeKey(ct,key,keys,scanned[ct]))
         {
-        if(keys.find(*prod->key())!=keys.end())
-            recirc=true;
-        else
-            keys[*prod->key()]=prod->type();
+        exhausted[ct]=true;
+        continue;
         }
-    if(recirc)
+    if(keys.size()>1)
+        out+=',';
+    out+=key;
+    out+=':';
+    node(out,flows,ct,0,values);
+    if(out.size()>=CHUNK)
         {
-            LOG("recirc object: " << *prod->key()
-                << " type: " << prod->type()
-                << " serial: " << prod->serial());
-
-        mProd->recirculate(prod);
-        continue;
+        auto size{out.size()};
+        flush(out);
+        flushed+=size-out.size();
         }
-    ss << c << *prod;
-    iCount+=prod->valueCount(Part::SimpleType::INT);
-    dCount+=prod->valueCount(Part::SimpleType::DOUBLE);
-    sCount+=prod->valueCount(Part::SimpleType::STRING);
     }
-ss << '}';
-auto s{ss.str()};
-auto end{std::chrono::steady_clock::now()};
-auto t{std::chrono::duration_cast<std::chrono::nanoseconds>(end-beg).count()};
-double d{1.0*t/1000000.0};
-LOG("Created [" << mInts << ',' << mDoubles << ','
-    << mStrings << "] in " << d << " ms for JSON of size: " << s.size());
-return s;
+out+='}';
+return values;
 }
 
 private:
 
-std::shared_ptr<Producer> mProd;
-int mInts{};
-int mDoubles{};
-int mStrings{};
+static constexpr std::size_t SOURCES{3+CT_COUNT};
+
+// Opening bracket of the products of a consumer, none for the keyed leaves
+// of K*, and the sources it takes Parts from
+struct Shape
+{
+char open;
+unsigned takes;
 };
 
-//------------------------------------------------------------------------------
-void initProducerKeys(ProducerParams& pp)
+static constexpr unsigned FLAT_ARRAYS{products({CT::AI,CT::AD,CT::AS,CT::AO})};
+static constexpr unsigned ARRAYS{FLAT_ARRAYS|products({CT::AA,CT::AM})};
+static constexpr unsigned OBJECTS{products({CT::OI,CT::OD,CT::OS,CT::OA
+    ,CT::OO,CT::OM})};
+
+static constexpr std::array<Shape,CT_COUNT> SHAPES{{
+     {'\0',leaves(0)} // KI
+    ,{'\0',leaves(1)} // KD
+    ,{'\0',leaves(2)} // KS
+    ,{'[',leaves(0)} // AI
+    ,{'[',leaves(1)} // AD
+    ,{'[',leaves(2)} // AS
+    ,{'[',FLAT_ARRAYS} // AA
+    ,{'[',OBJECTS} // AO
+    ,{'[',FLAT_ARRAYS} // AM
+    ,{'{',products({CT::KI})} // OI
+    ,{'{',products({CT::KD})} // OD
+    ,{'{',products({CT::KS})} // OS
+    ,{'{',ARRAYS} // OA
+    ,{'{',OBJECTS} // OO
+    ,{'{',OBJECTS} // OM
+    }};
+
+// Rates of shipping per CT, and of taking Parts per CT and source
+struct Flows
 {
-pp.setKeys(g_substantives);
+std::array<double,CT_COUNT> shipped{};
+std::array<std::array<double,SOURCES>,CT_COUNT> takes{};
+std::array<std::size_t,SOURCES> heights{};
+};
+
+static std::size_t rnd()
+{
+return mt();
 }
 
-//------------------------------------------------------------------------------
-void initProducerKeysMultiplier(ProducerParams& pp)
+/**
+Renders a key of the slice of ct not in keys yet into key and adds it: a
+random one, or when that is taken the next free one from scanned on, which
+keeps the scans of a document linear. Fails when the slice is used up.
+*/
+bool freeKey(
+    std::size_t ct,
+    std::string& key,
+    std::unordered_set<std::string>& keys,
+    std::size_t& scanned) const
 {
-pp.setKeyMultiplier(26*26*2);
+key.clear();
+mKeys->appendKey(key,mKeys->index(mTokens[ct],rnd()));
+if(keys.insert(key).second)
+    return true;
+
+for(auto count{mKeys->keyCount(mTokens[ct])}; scanned<count;)
+    {
+    key.clear();
+    mKeys->appendKey(key,mKeys->index(mTokens[ct],scanned++));
+    if(keys.insert(key).second)
+        return true;
+    }
+return false;
 }
 
-//------------------------------------------------------------------------------
-void initProducerValues(ProducerParams& pp)
+// Draws an index by the weights, their size if all are 0
+template<std::size_t N> static std::size_t draw(
+    std::array<double,N> const& weigths)
 {
-pp.addInts({0,1,2,3,4,5,6,7,8,9,});
-pp.addInts({10,11,12,13,14,15,16,17,18,19,});
-pp.addInts({110,111,112,113,114,115,116,117,118,119,});
-pp.addDoubles({0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9,1.0,});
-pp.addDoubles({10.1,10.2,10.3,10.4,10.5,10.6,10.7,10.8,10.9,11.0,});
-pp.addDoubles({110.11,110.21,110.31,110.41,110.15,110.61,110.71,110.18
-    ,110.19,111.02,});
-pp.addStrings({"A-0001","B-0010","C-0100","D-1000","E-1001","F-1010"
-    ,"G-1100","H-1101","I-1111",});
-pp.addStrings({"3212-ab","4230-bb","4901-cb","9443-db","8444-eg","3300-ff"
-    ,"5932-gb","0943-hb","4064-ig",});
+double total{};
+for(auto w: weigths)
+    total+=w;
+if(!(total>0))
+    return N;
+
+auto r{total*(rnd()/(1.0+std::mt19937::max()))};
+for(std::size_t i=0; i<N; ++i)
+    if(weigths[i]>0 && (r-=weigths[i])<0)
+        return i;
+for(auto i{N}; i; --i)
+    if(weigths[i-1]>0)
+        return i-1;
+return N;
 }
 
-//------------------------------------------------------------------------------
-using V_Counts=std::vector<std::tuple<int,int,int>>;
-std::set<std::string> threadize(ProducerParams& pp, V_Counts const& v)
+void flows(std::size_t types)
 {
-std::set<std::string> results;
-auto prod{std::make_shared<Producer>(pp)};
-auto futProducer{std::async(std::launch::async,
-    [&prod]
+auto& flows{mFlows[types]};
+std::array<double,SOURCES> in{};
+for(std::size_t t=0; t<3; ++t)
+    in[t]=(types>>t)&1 && !mLeaves[t].empty();
+for(std::size_t round=0; round<1000; ++round)
     {
-    auto res{prod->produce()};
-    LOG(res);
-    })};
-std::deque<std::future<std::string>> futs;
-for(auto const& i: v)
-    futs.push_back(std::async(std::launch::async,
-        [&prod,i]
-        {Assembly a{prod,std::get<0>(i),std::get<1>(i),std::get<2>(i)};
-        return a.run();
-        }));
-
-for(auto i{futs.begin()}; i!=futs.end();)
+    std::array<double,SOURCES> next{in[0],in[1],in[2]};
+    for(std::size_t src=0; src<SOURCES; ++src)
+        {
+        double takers{};
+        for(std::size_t ct=0; ct<CT_COUNT; ++ct)
+            if(!SHAPES[ct].open || (SHAPES[ct].takes>>src)&1)
+                takers+=mCons[ct].weigth;
+        for(std::size_t ct=0; ct<CT_COUNT; ++ct)
+            flows.takes[ct][src]=takers>0 && (SHAPES[ct].takes>>src)&1
+                ? in[src]*mCons[ct].weigth/takers : 0;
+        }
+    for(std::size_t ct=0; ct<CT_COUNT; ++ct)
+        {
+        auto const& cp{mCons[ct]};
+        double len{SHAPES[ct].open
+            ? std::max(1.0,(cp.min+std::max(cp.min,cp.max))/2.0) : 1.0};
+        double built{};
+        for(auto i: flows.takes[ct])
+            built+=i;
+        built/=len;
+        double recirc{cp.recirc && cp.recirc<=100 ? (cp.recirc-1)/100.0 : 0};
+        next[3+ct]=built*recirc;
+        flows.shipped[ct]=built*(1-recirc);
+        }
+    bool converged{true};
+    for(std::size_t src=0; src<SOURCES; ++src)
+        converged=converged && std::abs(next[src]-in[src])<=1e-12*(1+in[src]);
+    in=next;
+    if(converged)
+        break;
+    }
+// The least nesting each source bottoms out in leaves with
+for(std::size_t t=0; t<3; ++t)
+    flows.heights[t]=in[t]>0 ? 1 : 0;
+for(bool changed{true}; changed;)
+    {
+    changed=false;
+    for(std::size_t ct=0; ct<CT_COUNT; ++ct)
+        for(std::size_t src=0; src<SOURCES; ++src)
+            if(flows.takes[ct][src]>0 && flows.heights[src]
+               && (!flows.heights[3+ct]
+                   || flows.heights[src]+1<flows.heights[3+ct]))
+                {
+                flows.heights[3+ct]=flows.heights[src]+1;
+                changed=true;
+                }
+    }
+}
+
+// Draws the source of a member of ct, the shallowest ones past MAX_DEPTH
+std::size_t source(Flows const& flows, std::size_t ct, std::size_t depth) const
+{
+if(depth<MAX_DEPTH)
+    return draw(flows.takes[ct]);
+
+auto takes{flows.takes[ct]};
+std::size_t least{};
+for(std::size_t src=0; src<SOURCES; ++src)
+    if(takes[src]>0 && (!least || flows.heights[src]<least))
+        least=flows.heights[src];
+for(std::size_t src=0; src<SOURCES; ++src)
+    if(flows.heights[src]!=least)
+        takes[src]=0;
+return draw(takes);
+}
+
+void leaf(std::string& out, std::size_t type, std::array<std::size_t,3>& values)
+    const
+{
+auto const& groups{mLeaves[type]};
+auto r{rnd()};
+groups[r%groups.size()].appendTo(out,r/groups.size());
+++values[type];
+}
+
+// Appends the value of a product of ct
+void node(
+    std::string& out,
+    Flows const& flows,
+    std::size_t ct,
+    std::size_t depth,
+    std::array<std::size_t,3>& values) const
+{
+auto const& shape{SHAPES[ct]};
+if(!shape.open)
+    {
+    leaf(out,ct,values);
+    return;
+    }
+auto const& cp{mCons[ct]};
+auto len{cp.max<=cp.min ? cp.min : rnd()%(1+cp.max-cp.min)+cp.min};
+std::unordered_set<std::string> keys;
+std::string key;
+out+=shape.open;
+for(std::size_t i=0; i<len; ++i)
+    {
+    auto src{source(flows,ct,depth)};
+    if(src==SOURCES)
+        break;
+
+    if(shape.open=='{')
+        {
+        key.clear();
+        mKeys->appendKey(key,mKeys->index(mTokens[src-3],rnd()));
+        if(!keys.insert(key).second)
+            continue;
+        if(out.back()!=shape.open)
+            out+=',';
+        out+=key;
+        out+=':';
+        }
+    else if(out.back()!=shape.open)
+        out+=',';
+    if(src<3)
+        leaf(out,src,values);
+    else
+        node(out,flows,src-3,depth+1,values);
+    }
+out+=shape.open=='[' ? ']' : '}';
+}
+
+std::array<std::deque<SimpleValueGenerator>,3> mLeaves;
+std::shared_ptr<KeyGetter> mKeys;
+std::array<KeyGetter::Token,CT_COUNT> mTokens{};
+std::array<ProducerParams::ConsumerParams,CT_COUNT> mCons{};
+std::array<Flows,8> mFlows{};
+std::optional<std::uint32_t> mSeed;
+mutable std::atomic<std::size_t> mDocuments{};
+};
+
+//------------------------------------------------------------------------------
+struct Producer
+{
+enum IX
+{
+ FACTORY
+,PERCENTAGE
+,WEIGTH
+};
+
+// Tuple items:                   factory       ,recirc% ,weigth*
+using ConsumerProducer=std::tuple<FactoryBasePtr,unsigned,unsigned>;
+
+public:
+
+Producer(ProducerParams par)
+    : mSeed(par.seed())
+{
+// The factories draw their first lengths here
+if(mSeed)
+    mt.seed(*mSeed);
+auto pools{par.pools()};
+for(auto const& i: pools.literals[0])
+    mValueFIs.emplace_back(Part::Type::INT,i,false);
+
+for(auto const& i: pools.literals[1])
+    mValueFDs.emplace_back(Part::Type::DOUBLE,i,false);
+
+for(auto const& i: pools.literals[2])
+    mValueFSs.emplace_back(Part::Type::STRING,i,pools.rawStrings);
+
+mKeyGetter=std::make_shared<KeyGetter>(
+    pools.keys,pools.rawKeys,par.keyMultiplier());
+
+init(
+     tie2(mKvpFI,mKeyGetter)
+    ,tie2(mKvpFD,mKeyGetter)
+    ,tie2(mKvpFS,mKeyGetter)
+    ,tie5(mArrayFI,par[CT::AI].min,par[CT::AI].max,true,mKeyGetter)
+    ,tie5(mArrayFD,par[CT::AD].min,par[CT::AD].max,true,mKeyGetter)
+    ,tie5(mArrayFS,par[CT::AS].min,par[CT::AS].max,true,mKeyGetter)
+    ,tie5(mObjectFI,par[CT::OI].min,par[CT::OI].max,true,mKeyGetter)
+    ,tie5(mObjectFD,par[CT::OD].min,par[CT::OD].max,true,mKeyGetter)
+    ,tie5(mObjectFS,par[CT::OS].min,par[CT::OS].max,true,mKeyGetter)
+    ,tie5(mObjArray,par[CT::AO].min,par[CT::AO].max,true,mKeyGetter)
+    ,tie5(mArrayArray,par[CT::AA].min,par[CT::AA].max,true,mKeyGetter)
+    ,tie5(mMixedArray,par[CT::AM].min,par[CT::AM].max,true,mKeyGetter)
+    ,tie5(mArrayObj,par[CT::OA].min,par[CT::OA].max,true,mKeyGetter)
+    ,tie5(mObjObj,par[CT::OO].min,par[CT::OO].max,true,mKeyGetter)
+    ,tie5(mMixedObj,par[CT::OM].min,par[CT::OM].max,true,mKeyGetter));
+
+mKeyGetter->activate();
+
+mConsumers={
+     {mKvpFI,par[CT::KI].recirc,par[CT::KI].weigth}
+    ,{mKvpFD,par[CT::KD].recirc,par[CT::KD].weigth}
+    ,{mKvpFS,par[CT::KS].recirc,par[CT::KS].weigth}
+
+    ,{mArrayFI,par[CT::AI].recirc,par[CT::AI].weigth}
+    ,{mArrayFD,par[CT::AD].recirc,par[CT::AD].weigth}
+    ,{mArrayFS,par[CT::AS].recirc,par[CT::AS].weigth}
+
+    ,{mArrayArray,par[CT::AA].recirc,par[CT::AA].weigth}
+    ,{mObjArray,par[CT::AO].recirc,par[CT::AO].weigth}
+    ,{mMixedArray,par[CT::AM].recirc,par[CT::AM].weigth}
+
+    ,{mObjectFI,par[CT::OI].recirc,par[CT::OI].weigth}
+    ,{mObjectFD,par[CT::OD].recirc,par[CT::OD].weigth}
+    ,{mObjectFS,par[CT::OS].recirc,par[CT::OS].weigth}
+
+    ,{mArrayObj,par[CT::OA].recirc,par[CT::OA].weigth}
+    ,{mObjObj,par[CT::OO].recirc,par[CT::OO].weigth}
+    ,{mMixedObj,par[CT::OM].recirc,par[CT::OM].weigth}
+    };
+containerFactories([this](std::size_t, ContainerFactoryBase& factory)
+    {
+    mHolders.push_back(&factory);
+    });
+mPreset=par.preset();
+mQueueCapacity=par.queueCapacity();
+mMemoryBudget=par.memoryBudget();
+mStockLow=par.stockLow();
+mStockHigh=par.stockHigh();
+mSignature=par.signature();
+if(par.engine()==ProducerParams::Engine::DIRECT)
+    {
+    mDirect=std::make_shared<DirectEngine const>(par);
+    mStockLow=mStockHigh=0;
+    }
+else if(par.adaptive())
+    mController.emplace(mConsumers);
+if(Inventory::instance().enabled())
+    if(auto stock{Inventory::instance().withdraw(mSignature)})
+        restock(*stock);
+}
+
+/**
+Orders leaves, returning their count. The order is recorded as demand, which
+is turned into Parts in the work queue as far as the queue capacity and the
+memory budget allow, the rest waiting for room. Unlimited, the whole order
+gets queued right away. Pending demand is only a count, so ordering does not
+block: an Assembly waiting here for room could hold up the very Products
+that take up the budget.
+*/
+std::size_t order(int ints, int doubles, int strings)
+{
+TraceSpan span{"order"};
+std::size_t count{};
+for(auto [i,n]: {std::pair{0,ints},{1,doubles},{2,strings}})
+    if(n>0)
+        {
+        mDemand[i]+=n+1;
+        count+=n+1;
+        }
+g_metrics.leavesOrdered+=count;
+fill();
+return count;
+}
+
+// Blocks while the work queue has no room, as the Producer keeps draining it
+void recirculate(PartPtr p)
+{
+if(!p)
+    return;
+
+++g_metrics.assemblyRecirculated;
+p->clearMisses();
+if(!limited())
+    {
+    mParts.push_back(p);
+    return;
+    }
+wake();
+if(mParts.waitPush(p,[this](std::size_t size, std::size_t bytes)
+    {
+    return full(size,bytes);
+    }))
+    ++g_metrics.backpressureWaits;
+}
+
+/**
+Seeds the random generator of the calling thread, an Assembly thread, from
+the seed and the thread's index, as orders fill the work queue there. Does
+nothing unless seeded.
+*/
+void seedThread(std::size_t index) const
+{
+if(!mSeed)
+    return;
+std::seed_seq seq{*mSeed,static_cast<std::uint32_t>(index+1)};
+mt.seed(seq);
+}
+
+void done()
+{
+mDone=true;
+mParts.notifyRoom();
+wake();
+}
+
+void wake()
+{
+std::lock_guard lock{mMuxCvProd};
+mCvProd.notify_one();
+}
+
+// Returns when there are Products to take or the Producer ran out of Parts
+void waitProducts()
+{
+if(mProducts.empty())
+    mStarved=true;
+std::unique_lock lock{mMuxCvAsse};
+mCvAsse.wait_for(lock,10ms,[this]
+    {
+    return !mProducts.empty() || (mParts.empty() && !demand());
+    });
+}
+
+// Keeping warm stock, taking from it below the low watermark wakes the
+// Producer for a refill
+PartPtr get()
+{
+auto part{mProducts.get()};
+if(part)
+    for(auto t: {Part::SimpleType::INT,Part::SimpleType::DOUBLE
+        ,Part::SimpleType::STRING})
+        mStocked[static_cast<std::size_t>(t)]-=part->valueCount(t);
+if(part && mStockHigh && understocked())
+    wake();
+if(part && mMemoryBudget)
+    mParts.notifyRoom();
+return part;
+}
+
+// The engine Assemblies use instead of the assembly line, if configured
+DirectEngine const* direct() const
+{
+return mDirect.get();
+}
+
+// Values of each type held in finished Products
+std::array<std::size_t,3> stocked() const
+{
+return {mStocked[0],mStocked[1],mStocked[2]};
+}
+
+/**
+Runs the assembly line until done(). Predefined presets run a pipeline
+specialized at compile time, where factories are called directly through
+their final types; custom (-c) parameters use the runtime consumer table,
+as does the adaptive mode, which tunes it.
+*/
+std::string produce()
+{
+SCOPED_TIMER("Producer::produce");
+if(mSeed)
+    mt.seed(*mSeed);
+if(mController)
+    return produceWith(DynamicConsumers{mConsumers});
+return produceStatic(static_cast<Presets*>(nullptr));
+}
+
+private:
+
+/**
+Feedback control of the runtime consumer table (--adaptive), updated every
+WINDOW cycles of the Producer loop:
+- the recirculation percentages set the nesting of the shape. The first
+  CALIBRATION windows run the configured ones, measuring the mean depth of
+  the shipped products as the target. When Assemblies waited on an empty
+  products queue during a window, each percentage drops by STEP points, so
+  that built Parts ship sooner, as long as the mean depth of the products
+  shipped since the last measure stays within TOLERANCE of the target; below
+  it, or while products are in stock, the percentages climb back by STEP
+  towards the configured ones.
+- weights follow the work queue composition: a factory taking over a quarter
+  of the queued Parts gains weight, up to MAX_GAIN times the configured one,
+  as its inputs pile up, one taking under a sixteenth loses it, down to 1, and
+  the others, and all while the shipped products are too shallow, move back
+  towards the configured weight. Factories configured off stay off.
+*/
+struct Controller
+{
+static constexpr std::size_t WINDOW{256};
+static constexpr std::size_t CALIBRATION{8};
+static constexpr std::size_t SAMPLES{64};
+static constexpr double TOLERANCE{0.1};
+static constexpr unsigned STEP{5};
+static constexpr unsigned MAX_GAIN{4};
+
+// Part::kind()s each factory takes, indexed by CT
+static constexpr std::array<unsigned,CT_COUNT> INPUTS{
+     1u<<0,1u<<2,1u<<4
+    ,1u<<0,1u<<2,1u<<4,3u<<6,3u<<8,3u<<6
+    ,1u<<1,1u<<3,1u<<5,1u<<7,1u<<9,1u<<9};
+
+explicit Controller(std::vector<ConsumerProducer> const& consumers)
+{
+for(auto const& i: consumers)
+    mBase.emplace_back(std::get<IX::PERCENTAGE>(i),std::get<IX::WEIGTH>(i));
+}
+
+void shipped(Part const& p)
+{
+mDepths+=p.depth();
+++mShipped;
+}
+
+// Returns whether the weights changed
+bool update(
+    std::vector<ConsumerProducer>& consumers,
+    std::array<std::size_t,Part::KINDS> const& queue,
+    bool starved,
+    bool stocked)
+{
+if(mWindows<CALIBRATION)
+    {
+    if(++mWindows==CALIBRATION && mShipped)
+        mTarget=1.0*mDepths/mShipped;
+    if(mWindows==CALIBRATION)
+        mDepths=mShipped=0;
+    return false;
+    }
+// Cuts wait for the products shipped at the current percentages to tell
+bool measured{mShipped>=SAMPLES};
+if(measured)
+    {
+    mDepth=1.0*mDepths/mShipped;
+    mShallow=mDepth<(1-TOLERANCE)*mTarget;
+    mDepths=mShipped=0;
+    }
+std::size_t total{};
+for(auto i: queue)
+    total+=i;
+bool changed{};
+for(std::size_t ct=0; ct<consumers.size(); ++ct)
+    {
+    auto [recirc,weigth]{mBase[ct]};
+    auto& r{std::get<IX::PERCENTAGE>(consumers[ct])};
+    if(mShallow || (!starved && stocked))
+        r=std::min(recirc,r+STEP);
+    else if(starved && measured)
+        r-=std::min(r,STEP);
+
+    if(!weigth || !total)
+        continue;
+    std::size_t taken{};
+    for(std::size_t k=0; k<Part::KINDS; ++k)
+        if(INPUTS[ct]&(1u<<k))
+            taken+=queue[k];
+    auto& w{std::get<IX::WEIGTH>(consumers[ct])};
+    auto before{w};
+    if(mShallow)
+        {
+        if(w!=weigth)
+            w+=w<weigth ? 1 : -1;
+        }
+    else if(taken*4>total)
+        w=std::min(w+1,MAX_GAIN*weigth);
+    else if(taken*16<total)
+        w=std::max(w,2u)-1;
+    else if(w!=weigth)
+        w+=w<weigth ? 1 : -1;
+    changed|=w!=before;
+    }
+return changed;
+}
+
+std::string report(std::vector<ConsumerProducer> const& consumers) const
+{
+std::stringstream ss;
+ss << "Adaptive consumer params, recirc%,weigth (configured), shipped depth "
+   << mDepth << " (" << mTarget << "):";
+for(std::size_t ct=0; ct<consumers.size(); ++ct)
+    ss << (ct%5 ? " " : "\n  ") << CT_NAMES[ct] << ' '
+       << std::get<IX::PERCENTAGE>(consumers[ct]) << ','
+       << std::get<IX::WEIGTH>(consumers[ct]) << " (" << mBase[ct].first << ','
+       << mBase[ct].second << ')';
+return ss.str();
+}
+
+private:
+
+std::vector<std::pair<unsigned,unsigned>> mBase;
+std::size_t mWindows{};
+std::size_t mDepths{};
+std::size_t mShipped{};
+double mTarget{};
+double mDepth{};
+bool mShallow{};
+};
+
+// Consumer policies for produceWith(), indexed by CT
+struct DynamicConsumers
+{
+std::vector<std::size_t> keys() const
+{
+std::vector<std::size_t> keys;
+for(std::size_t i=0; i<mConsumers.size(); ++i)
+    for(std::size_t j=0; j<std::get<IX::WEIGTH>(mConsumers[i]); ++j)
+        keys.push_back(i);
+return keys;
+}
+
+std::size_t recirc(std::size_t ix) const
+{
+return std::get<IX::PERCENTAGE>(mConsumers[ix]);
+}
+
+PartPtr get(std::size_t ix, MuxParts& queue) const
+{
+SCOPED_TIMER_OF("factory get ",CT_NAMES,ix);
+return std::get<IX::FACTORY>(mConsumers[ix])->get(queue);
+}
+
+std::vector<ConsumerProducer> const& mConsumers;
+};
+
+template<typename P> struct StaticConsumers
+{
+static constexpr auto keys()
+{
+return presetKeys<P>();
+}
+
+static constexpr std::size_t recirc(std::size_t ix)
+{
+return P::TABLE[ix].recirc;
+}
+
+PartPtr get(std::size_t ix, MuxParts& queue) const
+{
+SCOPED_TIMER_OF("factory get ",CT_NAMES,ix);
+return mProd.getStatic(ix,queue,std::make_index_sequence<P::TABLE.size()>());
+}
+
+Producer& mProd;
+};
+
+// Factories in CT order, by their final types
+auto factories()
+{
+return std::tie(mKvpFI,mKvpFD,mKvpFS,mArrayFI,mArrayFD,mArrayFS
+    ,mArrayArray,mObjArray,mMixedArray,mObjectFI,mObjectFD,mObjectFS
+    ,mArrayObj,mObjObj,mMixedObj);
+}
+
+template<std::size_t... I> PartPtr getStatic(
+    std::size_t ix,
+    MuxParts& queue,
+    std::index_sequence<I...>)
+{
+PartPtr part;
+auto f{factories()};
+((ix==I && (part=std::get<I>(f)->get(queue),true)) || ...);
+return part;
+}
+
+template<typename... P> std::string produceStatic(std::tuple<P...>*)
+{
+std::string res;
+if(!((mPreset==P::NAME && (res=produceWith(StaticConsumers<P>{*this}),true))
+    || ...))
+    res=produceWith(DynamicConsumers{mConsumers});
+return res;
+}
+
+template<typename Consumers> std::string produceWith(Consumers const& consumers)
+{
+auto key{consumers.keys()};
+std::size_t madeProducts{};
+std::size_t cycles{};
+std::map<Part::Type,std::size_t> madeTypes;
+while(!mDone)
+    {
+    if(!(cycles++ % 16))
+        {
+        g_metrics.partsDepth.record(mParts.size());
+        g_metrics.productsDepth.record(mProducts.size());
+        }
+    if(mController && !(cycles % Controller::WINDOW)
+       && mController->update(mConsumers,mParts.composition()
+           ,mStarved.exchange(false),!mProducts.empty()))
+        key=consumers.keys();
+    if(demand())
+        fill();
+    else if(mStockHigh && mParts.empty())
+        refill();
+    if(mParts.empty())
+        {
+        TraceSpan span{"idle"};
+        std::unique_lock lock{mMuxCvProd};
+        mCvProd.wait(lock,[&mParts=mParts,&mDone=mDone]
+            {
+            return !mParts.empty() || mDone;
+            });
+        continue;
+        }
+    auto candidate{mParts.front()->serial()};
+    for(auto n{key.size()}; n; --n)
+        {
+        auto ix{mt() % n};
+        auto ixx{key[ix]};
+        std::swap(key[ix],key[n-1]);
+        auto part{consumers.get(ixx,mParts)};
+        ++g_metrics.factoryCalls[ixx];
+        if(part)
+            {
+            ++g_metrics.factoryBuilds[ixx];
+            if(100-consumers.recirc(ixx) < mt()%100)
+                {
+                ++g_metrics.recirculated;
+                traceInstant("recirc",part->serial());
+                mParts.push_back(part);
+                }
+            else
+                {
+                ++g_metrics.shipped;
+                traceInstant("product shipped",part->serial());
+                ++madeTypes[part->type()];
+                if(mController)
+                    mController->shipped(*part);
+                ship(part);
+                notifyAssemblies();
+                if(!(++madeProducts % 100))
+                    {
+                    DisNDat<> c("",", ");
+                    std::stringstream ss;
+                    ss << "Products created: " << madeProducts << " (";
+                    for(auto const& [k,v]: madeTypes)
+                        ss << c << k << ": " << v;
+
+                    ss << "); queue size: " << mParts.size();
+                    LOGV(ss.str());
+                    }
+                }
+            }
+        }
+    if(mParts.empty())
+        notifyAssemblies();
+    else if(candidate==mParts.front()->serial())
+        {
+        if(mParts.front()->miss()>2)
+            {
+            LOGV("NOT CONSUMED: " << *mParts.front());
+            ++g_metrics.forceShipped;
+            traceInstant("force shipped",candidate);
+            ship(mParts.front());
+            mParts.pop_front();
+            if(mParts.empty())
+                notifyAssemblies();
+            }
+        else
+            mParts.rotate();
+        }
+    // The pushes above only put back what the factories took off the queue,
+    // so room is left to the waiting Assemblies here, once per round
+    if(limited())
+        mParts.notifyRoom();
+    }
+if(mController)
+    LOG(mController->report(mConsumers));
+LOGV("Total products created: " << madeProducts
+    << "\nLeftover queue size: " << mParts.size()
+    << "\nLeftover demand: " << mDemand[0] << ',' << mDemand[1] << ','
+    << mDemand[2]
+    << "\nLeftover products: ");
+if(Inventory::instance().enabled())
+    {
+    Inventory::instance().deposit(mSignature,stock(),mMemoryBudget);
+    return std::string();
+    }
+DisNDat<> c("",",");
+std::stringstream ss;
+while(!mProducts.empty())
+    {
+    ss << c << *mProducts.front();
+    mProducts.pop_front();
+    }
+return ss.str();
+}
+
+// Applies f to the container factories with their CT index
+template<typename F> void containerFactories(F&& f)
+{
+std::size_t ct{};
+std::apply([&](auto&... factory)
+    {
+    (([&](auto& factory)
+        {
+        using T=typename std::decay_t<decltype(factory)>::element_type;
+        if constexpr(std::is_base_of_v<ContainerFactoryBase,T>)
+            f(ct,*factory);
+        ++ct;
+        }(factory)),...);
+    },factories());
+}
+
+Inventory::Stock stock()
+{
+Inventory::Stock stock;
+for(auto p{get()}; p; p=get())
+    stock.products.push_back(p);
+for(auto p{mParts.get()}; p; p=mParts.get())
+    stock.parts.push_back(p);
+containerFactories([&stock](std::size_t ct, ContainerFactoryBase& factory)
+    {
+    stock.buffers[ct]=factory.drain();
+    });
+return stock;
+}
+
+void restock(Inventory::Stock const& stock)
+{
+for(auto const& i: stock.products)
+    ship(i);
+for(auto const& i: stock.parts)
+    if(!mQueueCapacity || mParts.size()<mQueueCapacity)
+        mParts.push_back(i);
+containerFactories([&stock](std::size_t ct, ContainerFactoryBase& factory)
+    {
+    factory.restock(stock.buffers[ct]);
+    });
+}
+
+void ship(PartPtr const& part)
+{
+part->clearMisses();
+for(auto t: {Part::SimpleType::INT,Part::SimpleType::DOUBLE
+    ,Part::SimpleType::STRING})
+    mStocked[static_cast<std::size_t>(t)]+=part->valueCount(t);
+mProducts.push_back(part);
+}
+
+bool understocked() const
+{
+return mStocked[0]<mStockLow || mStocked[1]<mStockLow
+    || mStocked[2]<mStockLow;
+}
+
+// Orders the values taking the stock up to the high watermark, once it fell
+// under the low one
+void refill()
+{
+if(!understocked())
+    return;
+
+auto need{[this](std::size_t stocked)
+    {
+    return stocked<mStockHigh ? static_cast<int>(mStockHigh-stocked) : 0;
+    }};
+++g_metrics.stockRefills;
+order(need(mStocked[0]),need(mStocked[1]),need(mStocked[2]));
+}
+
+bool demand() const
+{
+return mDemand[0] || mDemand[1] || mDemand[2];
+}
+
+bool limited() const
+{
+return mQueueCapacity || mMemoryBudget;
+}
+
+// Bytes of the Parts collected in the container factories
+std::size_t held() const
+{
+std::size_t bytes{};
+for(auto i: mHolders)
+    bytes+=i->heldBytes();
+return bytes;
+}
+
+/**
+Whether a work queue of size Parts and bytes has no room for another Part:
+at capacity, or with the Parts queued and held by the factories and the
+Products taking up the memory budget. An empty queue always has room, so
+the factories holding the budget get the Parts to complete with.
+*/
+bool full(std::size_t size, std::size_t bytes)
+{
+if(!size || mDone)
+    return false;
+return (mQueueCapacity && size>=mQueueCapacity)
+    || (mMemoryBudget && bytes+held()+mProducts.bytes()>=mMemoryBudget);
+}
+
+// Turns pending demand into leaves while there is room for them
+void fill()
+{
+std::lock_guard lock{mMuxFill};
+auto isFull{[this](std::size_t size, std::size_t bytes)
+    {
+    return full(size,bytes);
+    }};
+bool stalled{};
+auto leaves{[&](auto& generators, std::atomic<std::size_t>& demand)
+    {
+    if(!demand || generators.empty())
+        return;
+
+    auto ix{mt()%generators.size()};
+    if(!limited())
+        {
+        for(; demand; --demand)
+            mParts.push_back(generators[ix].get());
+        return;
+        }
+    for(; demand; --demand)
+        if(isFull(mParts.size(),mParts.bytes())
+           || !mParts.push_back(generators[ix].get(),isFull))
+            {
+            stalled=true;
+            return;
+            }
+    }};
+leaves(mValueFIs,mDemand[0]);
+leaves(mValueFDs,mDemand[1]);
+leaves(mValueFSs,mDemand[2]);
+if(stalled)
+    ++g_metrics.backpressureWaits;
+}
+
+void notifyAssemblies()
+{
+std::lock_guard lock{mMuxCvAsse};
+mCvAsse.notify_all();
+}
+
+std::deque<SimpleValueGenerator> mValueFIs;
+std::deque<SimpleValueGenerator> mValueFDs;
+std::deque<SimpleValueGenerator> mValueFSs;
+
+SimpleKvPairFactory<Part::SimpleType::INT>::Ptr mKvpFI;
+SimpleKvPairFactory<Part::SimpleType::DOUBLE>::Ptr mKvpFD;
+SimpleKvPairFactory<Part::SimpleType::STRING>::Ptr mKvpFS;
+
+SimpleArrayFactory<Part::SimpleType::INT>::Ptr mArrayFI;
+SimpleArrayFactory<Part::SimpleType::DOUBLE>::Ptr mArrayFD;
+SimpleArrayFactory<Part::SimpleType::STRING>::Ptr mArrayFS;
+
+SimpleObjectFactory<Part::SimpleType::INT>::Ptr mObjectFI;
+SimpleObjectFactory<Part::SimpleType::DOUBLE>::Ptr mObjectFD;
+SimpleObjectFactory<Part::SimpleType::STRING>::Ptr mObjectFS;
+
+ObjectArrayFactory::Ptr mObjArray;
+ArrayArrayFactory::Ptr mArrayArray;
+ArrayArrayFactory::Ptr mMixedArray;
+
+ArrayObjectFactory::Ptr mArrayObj;
+ObjectObjectFactory::Ptr mObjObj;
+ObjectObjectFactory::Ptr mMixedObj;
+
+std::vector<ConsumerProducer> mConsumers;
+std::string mPreset;
+std::size_t mQueueCapacity{};
+std::size_t mMemoryBudget{};
+std::string mSignature;
+std::size_t mStockLow{};
+std::size_t mStockHigh{};
+std::array<std::atomic<std::size_t>,3> mDemand{};
+std::array<std::atomic<std::size_t>,3> mStocked{};
+std::mutex mMuxFill;
+
+MuxParts mParts;
+MuxParts mProducts;
+std::vector<ContainerFactoryBase const*> mHolders;
+KeyGetterBasePtr mKeyGetter;
+std::shared_ptr<DirectEngine const> mDirect;
+std::optional<Controller> mController;
+std::optional<std::uint32_t> mSeed;
+std::atomic<bool> mStarved{};
+std::atomic<bool> mDone{};
+std::mutex mMuxCvProd;
+std::mutex mMuxCvAsse;
+std::condition_variable mCvProd;
+std::condition_variable mCvAsse;
+};
+
+//------------------------------------------------------------------------------
+struct Assembly
+{
+// Rough serialized size of a keyed simple value, for ordering by bytes
+static constexpr std::size_t LEAF_BYTES{24};
+
+// Documents from this size on get stitched by several threads, each taking
+// at least STITCH_BYTES
+static constexpr std::size_t PARALLEL_BYTES{8u<<20};
+static constexpr std::size_t STITCH_BYTES{2u<<20};
+
+// Key collisions in a row taken for the key space being used up: as long as
+// one key in 64k is free, such a run is unlikely
+static constexpr std::size_t MAX_COLLISIONS{1u<<16};
+
+Assembly(
+    std::shared_ptr<Producer> prod,
+    Counts const& counts,
+    std::ostream* out=nullptr,
+    Encoder::Format format=Encoder::Format::JSON)
+    : mProd(prod)
+    , mInts(std::get<0>(counts))
+    , mDoubles(std::get<1>(counts))
+    , mStrings(std::get<2>(counts))
+    , mBytes(std::get<3>(counts))
+    , mOut(format==Encoder::Format::JSON ? out : nullptr)
+    , mEncodedOut(format==Encoder::Format::JSON ? nullptr : out)
+    , mFormat(format)
+{}
+
+/**
+Assembles one JSON object having at least the requested amount of values and
+bytes, the latter tracked exactly from the cached Part sizes. Without an
+output stream the object is built into a buffer preallocated to its exact
+size and returned. With a stream (streaming mode) the opening brace and every
+accepted Product are written out as soon as they arrive, so only the pending
+frontier stays in memory, and the returned string is empty. The binary
+encodings are written from the Part tree once the object is complete, into
+the stream if any. Throws std::runtime_error when MAX_COLLISIONS Products in
+a row came with keys taken already.
+*/
+std::string run()
+{
+TraceSpan span{"assembly"};
+SCOPED_TIMER("Assembly::run");
+auto beg{std::chrono::steady_clock::now()};
+if(auto direct{mProd->direct()})
+    return runDirect(*direct,beg);
+
+auto bytesOrder{static_cast<int>(mBytes/LEAF_BYTES/3)};
+auto stocked{mProd->stocked()};
+auto cold{[bytesOrder](int count, std::size_t stocked)
+    {
+    return std::max(count,bytesOrder)-static_cast<int>(stocked);
+    }};
+order(cold(mInts,stocked[0]),cold(mDoubles,stocked[1]),
+    cold(mStrings,stocked[2]));
+mProd->wake();
+if(mOut)
+    *mOut << '{';
+waitProducts();
+int iCount{};
+int dCount{};
+int sCount{};
+std::size_t size{2};
+DisNDat<> c("",",");
+D_PartPtr members;
+std::map<std::string,Part::Type> keys;
+std::size_t collisions{};
+while(iCount<mInts || dCount<mDoubles || sCount<mStrings || size<mBytes)
+    {
+    auto prod{mProd->get()};
+    if(!prod)
+        {
+        bool bytes{size<mBytes};
+        order(mInts-iCount>0 || bytes ? 1:0,
+            mDoubles-dCount>0 || bytes ? 1:0,mStrings-sCount>0 || bytes ? 1:0);
+        mProd->wake();
+        waitProducts();
+        continue;
+        }
+    bool recirc{};
+    if(!prod->key())
+        recirc=true;
+    else
+        {
+        if(keys.find(*prod->key())!=keys.end())
+            {
+            recirc=true;
+            if(++collisions==MAX_COLLISIONS)
+                {
+                mProd->recirculate(prod);
+                throw keySpaceExhausted(size,iCount,dCount,sCount);
+                }
+            }
+        else
+            {
+            keys[*prod->key()]=prod->type();
+            collisions=0;
+            }
+        }
+    if(recirc)
+        {
+            LOGV("recirc object: " << *prod->key()
+                << " type: " << prod->type()
+                << " serial: " << prod->serial());
+
+        traceInstant("assembly recirc",prod->serial());
+        mProd->recirculate(prod);
+        continue;
+        }
+    if(mOut)
+        *mOut << c << *prod;
+    else
+        members.push_back(prod);
+    size+=prod->size()+(keys.size()>1 ? 1 : 0);
+    iCount+=prod->valueCount(Part::SimpleType::INT);
+    dCount+=prod->valueCount(Part::SimpleType::DOUBLE);
+    sCount+=prod->valueCount(Part::SimpleType::STRING);
+    }
+std::string s;
+if(mOut)
+    {
+    *mOut << '}';
+    mOut->flush();
+    }
+else
+    s=serialize(members,size);
+finish(beg,iCount+dCount+sCount,size);
+if(mEncodedOut)
+    {
+    mEncodedOut->write(s.data(),s.size());
+    mEncodedOut->flush();
+    s.clear();
+    }
+return s;
+}
+
+// Values delivered and duration of the last run()
+std::size_t values() const
+{
+return mValues;
+}
+
+std::int64_t nanos() const
+{
+return mNanos;
+}
+
+private:
+
+/**
+Serializes the members in parallel into a buffer of the exact size: their
+offsets follow from the cached Part sizes, so the member list gets cut into
+runs of about equal bytes, each copied into place by a thread of its own.
+*/
+static std::string stitch(D_PartPtr const& members, std::size_t size)
+{
+std::vector<std::size_t> offsets;
+offsets.reserve(members.size());
+std::size_t pos{1};
+for(auto const& i: members)
+    {
+    offsets.push_back(pos);
+    pos+=i->size()+1;
+    }
+std::string s(size,',');
+s.front()='{';
+s.back()='}';
+
+auto threads{std::min<std::size_t>(size/STITCH_BYTES
+    ,std::max(1u,std::thread::hardware_concurrency()))};
+std::deque<std::future<void>> futs;
+std::size_t beg{};
+for(std::size_t n=1; n<=threads; ++n)
+    {
+    auto end{beg};
+    while(end<members.size() && (n==threads || offsets[end]<size/threads*n))
+        ++end;
+    futs.push_back(std::async(std::launch::async,[&,beg,end]
+        {
+        TraceSpan span{"stitch"};
+        for(auto i{beg}; i<end; ++i)
+            members[i]->copyTo(s.data()+offsets[i]);
+        }));
+    beg=end;
+    }
+for(auto& i: futs)
+    i.wait();
+++g_metrics.parallelStitches;
+return s;
+}
+
+// The members as the document, size being their JSON size
+std::string serialize(D_PartPtr const& members, std::size_t size) const
+{
+SCOPED_TIMER("Assembly serialize");
+if(mFormat!=Encoder::Format::JSON)
+    return encode(members,size);
+if(size>=PARALLEL_BYTES)
+    return stitch(members,size);
+
+std::string s;
+s.reserve(size);
+s+='{';
+for(auto const& i: members)
+    {
+    if(s.size()>1)
+        s+=',';
+    i->appendTo(s);
+    }
+s+='}';
+return s;
+}
+
+// The members as a CBOR or MessagePack map, size being their JSON size
+std::string encode(D_PartPtr const& members, std::size_t size) const
+{
+std::string s;
+s.reserve(size);
+Encoder e(mFormat,s);
+e.map(members.size());
+for(auto const& i: members)
+    e.member(*i);
+return s;
+}
+
+// The document sampled by the direct engine, streamed in chunks when mOut
+std::string runDirect(
+    DirectEngine const& direct,
+    std::chrono::steady_clock::time_point beg)
+{
+SCOPED_TIMER("Assembly direct");
+std::string s;
+std::size_t size{};
+auto values{direct.document(s,{mInts,mDoubles,mStrings,mBytes},
+    [this,&size](std::string& s)
+    {
+    if(mOut)
+        {
+        mOut->write(s.data(),s.size());
+        size+=s.size();
+        s.clear();
+        }
+    })};
+size+=s.size();
+if(mOut)
+    {
+    mOut->write(s.data(),s.size());
+    mOut->flush();
+    s.clear();
+    }
+finish(beg,values[0]+values[1]+values[2],size);
+return s;
+}
+
+void finish(
+    std::chrono::steady_clock::time_point beg,
+    std::size_t delivered,
+    std::size_t size)
+{
+auto end{std::chrono::steady_clock::now()};
+auto t{std::chrono::duration_cast<std::chrono::nanoseconds>(end-beg).count()};
+double d{1.0*t/1000000.0};
+g_metrics.leavesDelivered+=delivered;
+mValues=delivered;
+mNanos=t;
+g_metrics.requestLatencyUs.record(t/1000);
+g_metrics.requestWastedPct.record(
+    mOrdered>delivered ? (mOrdered-delivered)*100/mOrdered : 0);
+LOGV((mOut ? "Streamed [" : "Created [") << mInts << ',' << mDoubles << ','
+    << mStrings << ',' << mBytes << "] in " << d
+    << " ms for JSON of size: " << size);
+}
+
+void order(int ints, int doubles, int strings)
+{
+SCOPED_TIMER("Assembly order");
+mOrdered+=mProd->order(ints,doubles,strings);
+}
+
+// Streamed members get pushed downstream before blocking on the Producer.
+// The wait is bounded, as the Producer may have notified before we got here.
+void waitProducts()
+{
+if(mOut)
+    mOut->flush();
+
+TraceSpan span{"wait products"};
+SCOPED_TIMER("Assembly wait products");
+mProd->waitProducts();
+}
+
+std::shared_ptr<Producer> mProd;
+int mInts{};
+int mDoubles{};
+int mStrings{};
+std::size_t mBytes{};
+std::ostream* mOut{};
+std::ostream* mEncodedOut{};
+Encoder::Format mFormat;
+std::size_t mOrdered{};
+std::size_t mValues{};
+std::int64_t mNanos{};
+};
+
+//------------------------------------------------------------------------------
+void initProducerKeys(ProducerParams& pp)
+{
+pp.setKeys(g_substantives);
+}
+
+//------------------------------------------------------------------------------
+void initProducerKeysMultiplier(ProducerParams& pp)
+{
+pp.setKeyMultiplier(26*26*2);
+}
+
+//------------------------------------------------------------------------------
+void initProducerValues(ProducerParams& pp)
+{
+pp.addInts({0,1,2,3,4,5,6,7,8,9,});
+pp.addInts({10,11,12,13,14,15,16,17,18,19,});
+pp.addInts({110,111,112,113,114,115,116,117,118,119,});
+pp.addDoubles({0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9,1.0,});
+pp.addDoubles({10.1,10.2,10.3,10.4,10.5,10.6,10.7,10.8,10.9,11.0,});
+pp.addDoubles({110.11,110.21,110.31,110.41,110.15,110.61,110.71,110.18
+    ,110.19,111.02,});
+pp.addStrings({"A-0001","B-0010","C-0100","D-1000","E-1001","F-1010"
+    ,"G-1100","H-1101","I-1111",});
+pp.addStrings({"3212-ab","4230-bb","4901-cb","9443-db","8444-eg","3300-ff"
+    ,"5932-gb","0943-hb","4064-ig",});
+}
+
+//------------------------------------------------------------------------------
+/**
+Output compression pigz style: the input is cut into blocks which get
+compressed in parallel into independent gzip members or zstd frames. Both
+formats decode a concatenation of those as the concatenated input, so the
+blocks are simply written in order. Only the formats compiled in with
+JSONIZER_ZLIB or JSONIZER_ZSTD are available.
+*/
+struct Compressor
+{
+enum class Format
+{
+NONE
+, GZIP
+, ZSTD
+};
+
+static constexpr std::size_t DEFAULT_BLOCK{1u<<20};
+static constexpr std::size_t MIN_BLOCK{4u<<10};
+static constexpr std::size_t MAX_BLOCK{1u<<30};
+
+static std::optional<Format> parse(std::string const& s)
+{
+if(s=="gzip")
+    return Format::GZIP;
+if(s=="zstd")
+    return Format::ZSTD;
+return std::nullopt;
+}
+
+static bool available(Format format)
+{
+#ifdef JSONIZER_ZLIB
+if(format==Format::GZIP)
+    return true;
+#endif
+#ifdef JSONIZER_ZSTD
+if(format==Format::ZSTD)
+    return true;
+#endif
+return format==Format::NONE;
+}
+
+void setFormat(Format rhs)
+{
+mFormat=rhs;
+}
+
+bool enabled() const
+{
+return mFormat!=Format::NONE;
+}
+
+// Codec default when negative
+void setLevel(int rhs)
+{
+mLevel=rhs;
+}
+
+void setBlockSize(std::size_t rhs)
+{
+mBlock=std::clamp(rhs,MIN_BLOCK,MAX_BLOCK);
+}
+
+std::size_t blockSize() const
+{
+return mBlock;
+}
+
+char const* suffix() const
+{
+switch(mFormat)
+    {
+    case Format::GZIP:
+        return ".gz";
+    case Format::ZSTD:
+        return ".zst";
+    default:
+        return "";
+    }
+}
+
+// One gzip member or zstd frame
+std::string block(std::string_view in) const
+{
+TraceSpan span{"compress"};
+std::string out;
+#ifdef JSONIZER_ZLIB
+if(mFormat==Format::GZIP)
+    {
+    z_stream z{};
+    if(deflateInit2(&z,mLevel<0 ? Z_DEFAULT_COMPRESSION : std::min(mLevel,9)
+        ,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY)!=Z_OK)
+        throw std::runtime_error("deflateInit2 failed");
+    out.resize(deflateBound(&z,in.size()));
+    z.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in=in.size();
+    z.next_out=reinterpret_cast<Bytef*>(out.data());
+    z.avail_out=out.size();
+    auto r{deflate(&z,Z_FINISH)};
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    if(r!=Z_STREAM_END)
+        throw std::runtime_error("deflate failed");
+    }
+#endif
+#ifdef JSONIZER_ZSTD
+if(mFormat==Format::ZSTD)
+    {
+    out.resize(ZSTD_compressBound(in.size()));
+    auto n{ZSTD_compress(out.data(),out.size(),in.data(),in.size()
+        ,mLevel<0 ? ZSTD_CLEVEL_DEFAULT
+            : std::min(mLevel,ZSTD_maxCLevel()))};
+    if(ZSTD_isError(n))
+        throw std::runtime_error(ZSTD_getErrorName(n));
+    out.resize(n);
+    }
+#endif
+++g_metrics.compressedBlocks;
+g_metrics.compressedBytesIn+=in.size();
+g_metrics.compressedBytesOut+=out.size();
+return out;
+}
+
+// All of data, blocks compressed by up to one thread per hardware thread
+std::string compress(std::string_view data) const
+{
+if(!enabled())
+    return std::string(data);
+if(data.size()<=mBlock)
+    return block(data);
+
+std::string out;
+std::deque<std::future<std::string>> futs;
+auto threads{std::max(1u,std::thread::hardware_concurrency())};
+for(std::size_t pos{}; pos<data.size(); pos+=mBlock)
+    {
+    futs.push_back(std::async(std::launch::async,
+        [this,in=data.substr(pos,mBlock)]
+        {
+        return block(in);
+        }));
+    if(futs.size()>=threads)
+        {
+        out+=futs.front().get();
+        futs.pop_front();
+        }
+    }
+for(auto& i: futs)
+    out+=i.get();
+return out;
+}
+
+private:
+
+Format mFormat{Format::NONE};
+int mLevel{-1};
+std::size_t mBlock{DEFAULT_BLOCK};
+};
+
+//------------------------------------------------------------------------------
+/**
+Stream buffer compressing what gets written through it into the given
+stream, a block at a time in parallel as with Compressor::compress(), with
+up to one block in flight per hardware thread. A flush writes out the blocks
+finished so far without cutting the current one; close(), also called on
+destruction, writes the rest.
+*/
+struct CompressingBuf : public std::streambuf
+{
+CompressingBuf(std::ostream& out, Compressor const& z)
+    : mOut(out)
+    , mZ(z)
+    , mThreads(std::max(1u,std::thread::hardware_concurrency()))
+{
+mBlock.reserve(mZ.blockSize());
+}
+
+// Waits for the blocks in flight, dropping them and their errors; close()
+// first to get the output written and the errors reported
+~CompressingBuf()
+{
+for(auto& i: mPending)
+    i.wait();
+}
+
+// Compresses and writes what is buffered, throwing on a codec failure
+void close()
+{
+if(!mBlock.empty())
+    launch();
+while(!mPending.empty())
+    writeFront();
+mOut.flush();
+}
+
+protected:
+
+int_type overflow(int_type c) override
+{
+if(traits_type::eq_int_type(c,traits_type::eof()))
+    return traits_type::not_eof(c);
+
+char ch=traits_type::to_char_type(c);
+xsputn(&ch,1);
+return c;
+}
+
+std::streamsize xsputn(char const* s, std::streamsize n) override
+{
+for(std::string_view in(s,n); !in.empty();)
+    {
+    auto piece{in.substr(0,mZ.blockSize()-mBlock.size())};
+    mBlock.append(piece);
+    in.remove_prefix(piece.size());
+    if(mBlock.size()==mZ.blockSize())
+        launch();
+    }
+return n;
+}
+
+int sync() override
+{
+while(!mPending.empty()
+      && mPending.front().wait_for(0s)==std::future_status::ready)
+    writeFront();
+return mOut.flush() ? 0 : -1;
+}
+
+private:
+
+void launch()
+{
+mPending.push_back(std::async(std::launch::async,
+    [this,in=std::move(mBlock)]
+    {
+    return mZ.block(in);
+    }));
+mBlock.clear();
+mBlock.reserve(mZ.blockSize());
+if(mPending.size()>mThreads)
+    writeFront();
+}
+
+void writeFront()
+{
+auto s{mPending.front().get()};
+mPending.pop_front();
+mOut.write(s.data(),s.size());
+}
+
+std::ostream& mOut;
+Compressor mZ;
+std::size_t mThreads;
+std::string mBlock;
+std::deque<std::future<std::string>> mPending;
+};
+
+//------------------------------------------------------------------------------
+struct RunParams
+{
+void setStreamPrefix(std::string const& rhs)
+{
+mStreamPrefix=rhs;
+}
+
+std::string const& streamPrefix() const
+{
+return mStreamPrefix;
+}
+
+bool streaming() const
+{
+return !mStreamPrefix.empty();
+}
+
+void setCorpus(std::size_t rhs)
+{
+mCorpus=rhs;
+}
+
+std::size_t corpus() const
+{
+return mCorpus;
+}
+
+void setOut(std::string const& rhs)
+{
+mOut=rhs;
+}
+
+std::string const& out() const
+{
+return mOut;
+}
+
+void setJobs(std::size_t rhs)
+{
+mJobs=rhs;
+}
+
+std::size_t jobs() const
+{
+return mJobs ? mJobs : std::max(1u,std::thread::hardware_concurrency());
+}
+
+void setBenchEscape(std::size_t rhs)
+{
+mBenchEscape=rhs;
+}
+
+std::size_t benchEscape() const
+{
+return mBenchEscape;
+}
+
+void setBenchScaling(std::size_t rhs)
+{
+mBenchScaling=rhs;
+}
+
+std::size_t benchScaling() const
+{
+return mBenchScaling;
+}
+
+void setBenchDocs(std::size_t rhs)
+{
+mBenchDocs=rhs;
+}
+
+std::size_t benchDocs() const
+{
+return mBenchDocs;
+}
+
+void setBenchRuns(std::size_t rhs)
+{
+mBenchRuns=rhs;
+}
+
+std::size_t benchRuns() const
+{
+return mBenchRuns;
+}
+
+void setBaselineSave(std::string const& rhs)
+{
+mBaselineSave=rhs;
+}
+
+std::string const& baselineSave() const
+{
+return mBaselineSave;
+}
+
+void setBaselineCheck(std::string const& rhs)
+{
+mBaselineCheck=rhs;
+}
+
+std::string const& baselineCheck() const
+{
+return mBaselineCheck;
+}
+
+void setSeed(std::uint32_t rhs)
+{
+mSeed=rhs;
+}
+
+std::uint32_t seed() const
+{
+return mSeed;
+}
+
+void setServe(int rhs)
+{
+mServe=rhs;
+}
+
+int serve() const
+{
+return mServe;
+}
+
+void setLoad(int rhs)
+{
+mLoad=rhs;
+}
+
+int load() const
+{
+return mLoad;
+}
+
+void setConcurrency(std::size_t rhs)
+{
+mConcurrency=rhs;
+}
+
+std::size_t concurrency() const
+{
+return mConcurrency;
+}
+
+void setRate(double rhs)
+{
+mRate=rhs;
+}
+
+double rate() const
+{
+return mRate;
+}
+
+void setDuration(double rhs)
+{
+mDuration=rhs;
+}
+
+double duration() const
+{
+return mDuration;
+}
+
+void setMix(std::string const& rhs)
+{
+mMix=rhs;
+}
+
+std::string const& mix() const
+{
+return mMix;
+}
+
+void setNuma(bool rhs)
+{
+mNuma=rhs;
+}
+
+bool numa() const
+{
+return mNuma;
+}
+
+void setTrace(std::string const& rhs)
+{
+mTrace=rhs;
+}
+
+std::string const& trace() const
+{
+return mTrace;
+}
+
+void setMetrics(std::string const& rhs)
+{
+mMetrics=rhs;
+}
+
+std::string const& metrics() const
+{
+return mMetrics;
+}
+
+void setSnapshotSave(std::string const& rhs)
+{
+mSnapshotSave=rhs;
+}
+
+std::string const& snapshotSave() const
+{
+return mSnapshotSave;
+}
+
+void setRecycle(double rhs)
+{
+mRecycle=rhs;
+}
+
+void setEncoding(Encoder::Format rhs)
+{
+mEncoding=rhs;
+}
+
+Encoder::Format encoding() const
+{
+return mEncoding;
+}
+
+Compressor& compressor()
+{
+return mCompressor;
+}
+
+Compressor const& compressor() const
+{
+return mCompressor;
+}
+
+double recycle() const
+{
+return mRecycle;
+}
+
+private:
+
+std::string mStreamPrefix;
+std::size_t mCorpus{};
+std::string mOut;
+std::size_t mJobs{};
+std::string mMetrics;
+std::string mTrace;
+std::size_t mBenchScaling{};
+std::size_t mBenchEscape{};
+std::size_t mBenchDocs{20};
+std::size_t mBenchRuns{5};
+std::string mBaselineSave;
+std::string mBaselineCheck;
+std::uint32_t mSeed{1};
+int mServe{};
+int mLoad{};
+std::size_t mConcurrency{1};
+double mRate{};
+double mDuration{10};
+std::string mMix;
+bool mNuma{};
+double mRecycle{};
+std::string mSnapshotSave;
+Compressor mCompressor;
+Encoder::Format mEncoding{Encoder::Format::JSON};
+};
+
+//------------------------------------------------------------------------------
+/**
+NUMA topology from /sys/devices/system/node, and thread pinning by node with
+sched_setaffinity. Memory is placed node locally by first touch, so Producers
+get constructed and run on threads pinned to their node. Without NUMA
+information the whole machine is one node and pinning does nothing.
+*/
+struct Numa
+{
+static std::vector<std::vector<int>> const& topology()
+{
+static const auto topology{[]
+    {
+    std::vector<std::vector<int>> nodes;
+    for(std::size_t node=0;; ++node)
+        {
+        std::ifstream in("/sys/devices/system/node/node"
+            +std::to_string(node)+"/cpulist");
+        std::string list;
+        if(!std::getline(in,list))
+            break;
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        for(std::string range; std::getline(ss,range,',');)
+            {
+            auto dash{range.find('-')};
+            int first{std::stoi(range)};
+            int last{dash==std::string::npos
+                ? first : std::stoi(range.substr(dash+1))};
+            for(; first<=last; ++first)
+                cpus.push_back(first);
+            }
+        if(!cpus.empty())
+            nodes.push_back(cpus);
+        }
+    return nodes;
+    }()};
+return topology;
+}
+
+static std::size_t nodes()
+{
+return std::max<std::size_t>(1,topology().size());
+}
+
+static void pin(std::size_t node)
+{
+if(topology().size()<2)
+    return;
+
+cpu_set_t set;
+CPU_ZERO(&set);
+for(auto i: topology()[node%topology().size()])
+    CPU_SET(i,&set);
+if(sched_setaffinity(0,sizeof set,&set))
+    LOGV("Cannot pin thread to NUMA node " << node);
+}
+};
+
+//------------------------------------------------------------------------------
+// Runs the Assemblies of v, rethrowing a failed one once the Producers stopped
+std::set<std::string> threadize(
+    ProducerParams& pp,
+    V_Counts const& v,
+    RunParams const& rp=RunParams())
+{
+std::set<std::string> results;
+std::size_t nodes{rp.numa() ? Numa::nodes() : 1};
+std::vector<std::shared_ptr<Producer>> prods;
+std::deque<std::future<void>> futProducers;
+for(std::size_t node=0; node<nodes; ++node)
+    {
+    prods.push_back(std::async(std::launch::async,
+        [&pp,&rp,node]
+        {
+        if(rp.numa())
+            Numa::pin(node);
+        auto params{pp};
+        if(pp.seed())
+            params.setSeed(*pp.seed()+node);
+        return std::make_shared<Producer>(params);
+        }).get());
+    futProducers.push_back(std::async(std::launch::async,
+        [prod=prods.back(),&rp,node]
+        {
+        if(rp.numa())
+            Numa::pin(node);
+        traceThread("producer "+std::to_string(node));
+        auto res{prod->produce()};
+        LOGV(res);
+        }));
+    }
+std::deque<std::future<std::string>> futs;
+std::size_t n{};
+for(auto const& i: v)
+    futs.push_back(std::async(std::launch::async,
+        [prod=prods[n%nodes],&rp,i,n=n++]
+        {
+        if(rp.numa())
+            Numa::pin(n);
+        traceThread("assembly "+std::to_string(n));
+        prod->seedThread(n);
+        if(!rp.streaming())
+            {
+            Assembly a{prod,i,nullptr,rp.encoding()};
+            return a.run();
+            }
+        auto const& z{rp.compressor()};
+        auto name{rp.streamPrefix()+std::to_string(n)
+            +Encoder::suffix(rp.encoding())+z.suffix()};
+        // Written as .part, renamed once complete, removed on failure
+        auto part{name+".part"};
+        std::ofstream file(part,std::ios::binary);
+        if(!file.is_open())
+            throw std::runtime_error("Cannot open "+part);
+        try
+            {
+            std::optional<CompressingBuf> buf;
+            if(z.enabled())
+                buf.emplace(file,z);
+            std::ostream out(buf ? static_cast<std::streambuf*>(&*buf)
+                : file.rdbuf());
+            Assembly a{prod,i,&out,rp.encoding()};
+            a.run();
+            if(buf)
+                buf->close();
+            file.close();
+            if(!out.good() || !file.good())
+                throw std::runtime_error("Cannot write "+part);
+            std::filesystem::rename(part,name);
+            }
+        catch(...)
+            {
+            file.close();
+            std::error_code ec;
+            std::filesystem::remove(part,ec);
+            throw;
+            }
+        return "streamed to "+name;
+        }));
+
+std::string error;
+for(auto i{futs.begin()}; i!=futs.end();)
+    {
+    if(i->wait_for(1ms)==std::future_status::ready)
+        {
+        try
+            {
+            results.emplace(i->get());
+            }
+        catch(std::exception const& e)
+            {
+            error=e.what();
+            }
+        std::swap(*i,futs.back());
+        if(std::next(i)==futs.end())
+            i=futs.begin();
+
+        futs.pop_back();
+        if(futs.empty())
+            break;
+        }
+    else
+        if(++i==futs.end())
+            i=futs.begin();
+    }
+for(auto& i: prods)
+    i->done();
+for(auto& i: futProducers)
+    while(i.wait_for(1ms)!=std::future_status::ready);
+if(!error.empty())
+    throw std::runtime_error(error);
+return results;
+}
+
+//------------------------------------------------------------------------------
+/**
+Corpus output, either one NDJSON file (when the path ends with .ndjson) or
+a directory receiving one <N>.json file per document. NDJSON documents are
+batched per worker and appended under a lock in large chunks; per-file
+documents are written by the workers in parallel. With compression the
+file names get the codec suffix appended, and the NDJSON file is compressed
+in parallel blocks as it gets written. Binary encoded documents go to
+<N>.cbor or <N>.msgpack files, or get concatenated into one file, i.e. a CBOR
+sequence or a MessagePack stream, when the path ends with that suffix.
+*/
+struct CorpusSink
+{
+static constexpr std::size_t BATCH{4u<<20};
+
+CorpusSink(
+    std::string const& path,
+    Compressor const& z,
+    Encoder::Format format=Encoder::Format::JSON)
+    : mPath(path)
+    , mNdjson(endsWith(path,format==Encoder::Format::JSON ? ".ndjson"
+        : Encoder::suffix(format)))
+    , mBuffer(mNdjson ? BATCH : 0)
+    , mZ(z)
+    , mSuffix(Encoder::suffix(format))
+    , mSeparator(format==Encoder::Format::JSON)
+{
+if(mNdjson)
+    {
+    mFile.rdbuf()->pubsetbuf(mBuffer.data(),mBuffer.size());
+    mFile.open(path+mZ.suffix(),std::ios::binary|std::ios::trunc);
+    if(mZ.enabled())
+        mCompressing.emplace(mFile,mZ);
+    }
+else
+    {
+    std::error_code ec;
+    std::filesystem::create_directories(path,ec);
+    }
+}
+
+bool good() const
+{
+return !mFailed
+    && (mNdjson ? mFile.good() : std::filesystem::is_directory(mPath));
+}
+
+// Writes out what is still buffered, returning whether all got written
+bool close()
+{
+std::lock_guard lock{mMux};
+if(mCompressing)
+    try
+        {
+        mCompressing->close();
+        }
+    catch(std::exception const&)
+        {
+        mFailed=true;
+        }
+if(mNdjson)
+    mFile.flush();
+return good();
+}
+
+// Throws std::runtime_error when the document cannot be written
+void put(std::size_t n, std::string const& doc, std::string& batch)
+{
+if(!mNdjson)
+    {
+    auto name{mPath+"/"+std::to_string(n)+mSuffix+mZ.suffix()};
+    std::ofstream out(name,std::ios::binary);
+    if(!mZ.enabled())
+        out.write(doc.data(),doc.size());
+    else
+        {
+        auto z{mZ.compress(doc)};
+        out.write(z.data(),z.size());
+        }
+    out.close();
+    if(!out)
+        fail("Cannot write "+name);
+    return;
+    }
+batch+=doc;
+if(mSeparator)
+    batch+='\n';
+if(batch.size()>=BATCH)
+    flush(batch);
+}
+
+void flush(std::string& batch)
+{
+if(batch.empty())
+    return;
+
+std::lock_guard lock{mMux};
+if(mCompressing)
+    mCompressing->sputn(batch.data(),batch.size());
+else
+    mFile.write(batch.data(),batch.size());
+batch.clear();
+if(!mFile)
+    fail("Cannot write "+mPath+mZ.suffix());
+}
+
+private:
+
+void fail(std::string const& what)
+{
+mFailed=true;
+throw std::runtime_error(what);
+}
+
+static bool endsWith(std::string const& s, std::string const& suffix)
+{
+return s.size()>suffix.size()
+    && s.compare(s.size()-suffix.size(),suffix.size(),suffix)==0;
+}
+
+std::string mPath;
+bool mNdjson{};
+std::vector<char> mBuffer;
+Compressor mZ;
+std::string mSuffix;
+bool mSeparator{};
+std::ofstream mFile;
+std::optional<CompressingBuf> mCompressing;
+std::mutex mMux;
+std::atomic<bool> mFailed{};
+};
+
+//------------------------------------------------------------------------------
+/**
+Bulk generation: rp.jobs() workers each own one Producer, which keeps running
+across all the documents the worker assembles, and take document indexes from
+a shared counter until rp.corpus() documents exist.
+*/
+int corpus(ProducerParams& pp, V_Counts const& v, RunParams const& rp)
+{
+CorpusSink sink(rp.out(),rp.compressor(),rp.encoding());
+if(!sink.good())
+    {
+    LOG("Cannot open corpus output: " << rp.out());
+    return ERRORS::CORPUS_OUTPUT;
+    }
+std::atomic<std::size_t> next{};
+std::atomic<std::size_t> bytes{};
+std::mutex muxError;
+std::string error;
+auto beg{std::chrono::steady_clock::now()};
+std::deque<std::future<void>> workers;
+for(std::size_t j=0; j<rp.jobs(); ++j)
+    workers.push_back(std::async(std::launch::async,
+        [&,j]
+        {
+        if(rp.numa())
+            Numa::pin(j);
+        traceThread("worker "+std::to_string(j));
+        auto params{pp};
+        if(pp.seed())
+            params.setSeed(*pp.seed()+j);
+        auto prod{std::make_shared<Producer>(params)};
+        auto futProducer{std::async(std::launch::async,
+            [&prod,&rp,j]
+            {
+            if(rp.numa())
+                Numa::pin(j);
+            traceThread("producer "+std::to_string(j));
+            auto res{prod->produce()};
+            LOGV(res);
+            })};
+        std::string batch;
+        try
+            {
+            for(auto n{next++}; n<rp.corpus(); n=next++)
+                {
+                auto const& i{v[n%v.size()]};
+                Assembly a{prod,i,nullptr,rp.encoding()};
+                auto doc{a.run()};
+                bytes+=doc.size();
+                sink.put(n,doc,batch);
+                }
+            sink.flush(batch);
+            }
+        catch(std::exception const& e)
+            {
+            next=rp.corpus();
+            std::lock_guard lock{muxError};
+            error=e.what();
+            }
+        prod->done();
+        futProducer.wait();
+        }));
+
+for(auto& i: workers)
+    i.wait();
+
+if(!sink.close())
+    {
+    LOG((error.empty() ? "Cannot write corpus output: "+rp.out() : error));
+    return ERRORS::CORPUS_OUTPUT;
+    }
+if(!error.empty())
+    {
+    LOG(error);
+    return ERRORS::ASSEMBLY;
+    }
+auto end{std::chrono::steady_clock::now()};
+auto t{std::chrono::duration_cast<std::chrono::nanoseconds>(end-beg).count()};
+double secs{t/1e9};
+LOG("Corpus of " << rp.corpus() << " documents, " << bytes << " bytes, in "
+    << secs*1000.0 << " ms with " << rp.jobs() << " workers: "
+    << rp.corpus()/secs << " documents/s, "
+    << bytes/1e6/secs << " MB/s");
+return 0;
+}
+
+//------------------------------------------------------------------------------
+struct WorkloadResult
+{
+std::size_t docs{};
+std::size_t values{};
+std::size_t bytes{};
+double seconds{};
+std::vector<double> latencies;
+
+// Latency in ms at quantile q, by nearest rank
+double percentile(double q)
+{
+if(latencies.empty())
+    return 0;
+
+std::sort(latencies.begin(),latencies.end());
+auto ix{static_cast<std::size_t>(q*(latencies.size()-1)+0.5)};
+return latencies[ix];
+}
+};
+
+//------------------------------------------------------------------------------
+/**
+threadize() equivalent workload: one Producer serving the given amount of
+concurrent Assemblies, each running docs requests back to back. Rethrows the
+error of a failed Assembly, as std::runtime_error, once the Producer stopped.
+*/
+WorkloadResult runWorkload(
+    ProducerParams const& pp,
+    Counts const& counts,
+    std::size_t concurrency,
+    std::size_t docs)
+{
+WorkloadResult res;
+std::mutex mux;
+std::atomic<bool> failed{};
+auto prod{std::make_shared<Producer>(pp)};
+auto futProducer{std::async(std::launch::async,
+    [&prod]
+    {
+    traceThread("producer");
+    prod->produce();
+    })};
+auto beg{std::chrono::steady_clock::now()};
+std::deque<std::future<void>> futs;
+for(std::size_t j=0; j<concurrency; ++j)
+    futs.push_back(std::async(std::launch::async,
+        [&,j]
+        {
+        traceThread("assembly "+std::to_string(j));
+        prod->seedThread(j);
+        for(std::size_t n=0; n<docs && !failed; ++n)
+            {
+            Assembly a{prod,counts};
+            std::string doc;
+            try
+                {
+                doc=a.run();
+                }
+            catch(...)
+                {
+                failed=true;
+                throw;
+                }
+            std::lock_guard lock{mux};
+            ++res.docs;
+            res.values+=a.values();
+            res.bytes+=doc.size();
+            res.latencies.push_back(a.nanos()/1e6);
+            }
+        }));
+
+std::string error;
+for(auto& i: futs)
+    try
+        {
+        i.get();
+        }
+    catch(std::exception const& e)
+        {
+        if(error.empty())
+            error=e.what();
+        }
+
+auto end{std::chrono::steady_clock::now()};
+res.seconds=std::chrono::duration<double>(end-beg).count();
+prod->done();
+futProducer.wait();
+if(!error.empty())
+    throw std::runtime_error(error);
+return res;
+}
+
+//------------------------------------------------------------------------------
+// Writes a benchmark report into --out if given, otherwise to stdout
+int report(std::string const& s, RunParams const& rp)
+{
+if(rp.out().empty())
+    {
+    std::lock_guard lock(muxLog);
+    std::cout << s;
+    return 0;
+    }
+std::ofstream out(rp.out(),std::ios::binary);
+out << s;
+if(!out.good())
+    {
+    LOG("Cannot write benchmark report: " << rp.out());
+    return ERRORS::BENCH_OUTPUT;
+    }
+return 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+End-to-end scaling benchmark: every predefined preset with 1, 2, 4 ... up to
+rp.benchScaling() concurrent Assemblies of the first -t/-b request, reported
+as JSON into rp.out(), or stdout. Fails with ERRORS::ASSEMBLY when a request
+does.
+*/
+int benchScaling(
+    std::map<std::string,ProducerParams> const& predefined,
+    Counts const& counts,
+    RunParams const& rp)
+{
+std::stringstream ss;
+ss << "{\"benchmark\":\"scaling\",\"request\":[" << std::get<0>(counts)
+   << ',' << std::get<1>(counts) << ',' << std::get<2>(counts) << ','
+   << std::get<3>(counts) << "],\"docs_per_thread\":" << rp.benchDocs()
+   << ",\"results\":[";
+DisNDat<> c("",",");
+for(auto const& [name,pp]: predefined)
+    for(std::size_t n=1; n<=rp.benchScaling(); n*=2)
+        {
+        WorkloadResult res;
+        try
+            {
+            res=runWorkload(pp,counts,n,rp.benchDocs());
+            }
+        catch(std::runtime_error const& e)
+            {
+            LOG(name << '/' << n << ": " << e.what());
+            return ERRORS::ASSEMBLY;
+            }
+        ss << c << "\n{\"preset\":\"" << name << "\",\"concurrency\":" << n
+           << ",\"documents\":" << res.docs
+           << ",\"seconds\":" << res.seconds
+           << ",\"docs_per_s\":" << res.docs/res.seconds
+           << ",\"values_per_s\":" << res.values/res.seconds
+           << ",\"bytes_per_s\":" << res.bytes/res.seconds
+           << ",\"p50_ms\":" << res.percentile(0.5)
+           << ",\"p99_ms\":" << res.percentile(0.99) << '}';
+        }
+ss << "\n]}\n";
+return report(ss.str(),rp);
+}
+
+//------------------------------------------------------------------------------
+/**
+String escaping benchmark: escapes a generated corpus of rp.benchEscape() MB
+of strings with each scanner available, for a clean, a mostly clean and a
+dirty corpus (none, 1 in 64 and 1 in 8 bytes needing an escape, reported as
+dirty_one_in 0, 64 and 8), and reports the best of
+rp.benchRuns() runs as JSON. Fails if a fast path disagrees with the scalar
+one.
+*/
+int benchEscape(RunParams const& rp)
+{
+std::vector<std::pair<char const*,escaping::Scan>> scans{
+    {"scalar",escaping::scanScalar}};
+#if defined(__x86_64__)
+scans.emplace_back("sse2",escaping::scanSse2);
+if(__builtin_cpu_supports("avx2"))
+    scans.emplace_back("avx2",escaping::scanAvx2);
+#endif
+std::mt19937 gen{rp.seed()};
+auto corpus{[&gen,&rp](unsigned dirty)
+    {
+    static constexpr char SPECIAL[]{"\"\\\b\f\n\r\t\x01\x1f"};
+    V_S v;
+    for(std::size_t bytes{}; bytes<(rp.benchEscape()<<20);)
+        {
+        std::string s(4+gen()%252,'\0');
+        for(auto& c: s)
+            c=!dirty || gen()%dirty ? static_cast<char>(' '+2+gen()%90)
+                : SPECIAL[gen()%(sizeof SPECIAL-1)];
+        bytes+=s.size();
+        v.push_back(std::move(s));
+        }
+    return v;
+    }};
+std::stringstream ss;
+ss << "{\"benchmark\":\"escape\",\"mb\":" << rp.benchEscape()
+   << ",\"results\":[";
+DisNDat<> c("",",");
+for(auto dirty: {0u,64u,8u})
     {
-    if(i->wait_for(1ms)==std::future_status::ready)
+    auto v{corpus(dirty)};
+    std::string expected;
+    for(auto const& [name,scan]: scans)
         {
-        auto res{i->get()};
-        results.emplace(res);
-        std::swap(*i,futs.back());
-        if(std::next(i)==futs.end())
-            i=futs.begin();
-
-        futs.pop_back();
-        if(futs.empty())
-            break;
+        double best{};
+        std::string out;
+        for(std::size_t run=0; run<rp.benchRuns(); ++run)
+            {
+            out.clear();
+            auto beg{std::chrono::steady_clock::now()};
+            for(auto const& i: v)
+                escaping::appendEscaped(out,i,scan);
+            auto end{std::chrono::steady_clock::now()};
+            auto mbs{(rp.benchEscape()<<20)/1e6
+                /std::chrono::duration<double>(end-beg).count()};
+            best=std::max(best,mbs);
+            }
+        if(expected.empty())
+            expected.swap(out);
+        else if(out!=expected)
+            {
+            LOG("Escaping mismatch of scanner " << name);
+            return ERRORS::BENCH_OUTPUT;
+            }
+        ss << c << "\n{\"scanner\":\"" << name << "\",\"dirty_one_in\":"
+           << dirty << ",\"mb_per_s\":" << best << '}';
         }
-    else
-        if(++i==futs.end())
-            i=futs.begin();
     }
-prod->done();
+ss << "\n]}\n";
+return report(ss.str(),rp);
+}
+
+//------------------------------------------------------------------------------
+// Median and median absolute deviation of repeated measurements
+struct Stat
+{
+double median{};
+double mad{};
+
+static double median_of(std::vector<double> v)
 {
-std::lock_guard lock{muxCvProd};
-cvProd.notify_one();
+if(v.empty())
+    return 0;
+
+std::sort(v.begin(),v.end());
+auto n{v.size()};
+return n%2 ? v[n/2] : (v[n/2-1]+v[n/2])/2;
 }
-while(futProducer.wait_for(1ms)!=std::future_status::ready);
-return results;
+
+explicit Stat(std::vector<double> const& v={})
+    : median(median_of(v))
+{
+std::vector<double> dev;
+for(auto i: v)
+    dev.push_back(std::abs(i-median));
+mad=median_of(dev);
+}
+
+Stat(double m, double d)
+    : median(m)
+    , mad(d)
+{}
+
+// Noise band: 3 scaled MADs, or the given fraction of the median if larger
+double threshold(double fraction) const
+{
+return std::max(3*1.4826*mad,fraction*median);
+}
+};
+
+//------------------------------------------------------------------------------
+/**
+Reader of the baselines baseline() writes: the workloads array of objects of
+a name and the docs_per_s and p50_ms stats, each of a median and a mad. Fields
+are looked up by name, in any order and whitespace, others being skipped.
+Throws std::runtime_error on malformed input.
+*/
+struct BaselineReader
+{
+using Workloads=std::map<std::string,std::pair<Stat,Stat>>;
+
+explicit BaselineReader(std::string s)
+    : mS(std::move(s))
+{}
+
+Workloads workloads()
+{
+Workloads res;
+object([&](std::string const& key)
+    {
+    if(key!="workloads")
+        return skip();
+    array([&]
+        {
+        std::string name;
+        Stat tput,lat;
+        object([&](std::string const& key)
+            {
+            if(key=="name")
+                name=string();
+            else if(key=="docs_per_s")
+                tput=stat();
+            else if(key=="p50_ms")
+                lat=stat();
+            else
+                skip();
+            });
+        if(name.empty())
+            fail("workload without a name");
+        res[name]={tput,lat};
+        });
+    });
+if(peek())
+    fail("trailing data");
+return res;
+}
+
+private:
+
+[[noreturn]] void fail(std::string const& what) const
+{
+throw std::runtime_error(what+" at offset "+std::to_string(mPos));
+}
+
+// The next non-blank character, 0 at the end
+char peek()
+{
+while(mPos<mS.size() && std::isspace(static_cast<unsigned char>(mS[mPos])))
+    ++mPos;
+return mPos<mS.size() ? mS[mPos] : 0;
+}
+
+void expect(char c)
+{
+if(peek()!=c)
+    fail(std::string("expected ")+c);
+++mPos;
+}
+
+bool next(char c)
+{
+if(peek()!=c)
+    return false;
+++mPos;
+return true;
+}
+
+template<typename F> void object(F&& f)
+{
+expect('{');
+if(next('}'))
+    return;
+do
+    {
+    auto key{string()};
+    expect(':');
+    f(key);
+    }
+while(next(','));
+expect('}');
+}
+
+template<typename F> void array(F&& f)
+{
+expect('[');
+if(next(']'))
+    return;
+do
+    f();
+while(next(','));
+expect(']');
+}
+
+std::string string()
+{
+expect('"');
+std::string res;
+for(; mPos<mS.size() && mS[mPos]!='"'; ++mPos)
+    {
+    if(mS[mPos]=='\\' && ++mPos==mS.size())
+        break;
+    res+=mS[mPos];
+    }
+expect('"');
+return res;
+}
+
+double number()
+{
+peek();
+double d{};
+auto [p,ec]{std::from_chars(mS.data()+mPos,mS.data()+mS.size(),d)};
+if(ec!=std::errc{})
+    fail("expected a number");
+mPos=p-mS.data();
+return d;
+}
+
+Stat stat()
+{
+Stat res;
+object([&](std::string const& key)
+    {
+    if(key=="median")
+        res.median=number();
+    else if(key=="mad")
+        res.mad=number();
+    else
+        skip();
+    });
+return res;
+}
+
+void skip()
+{
+switch(peek())
+    {
+    case '{':
+        object([this](std::string const&)
+            {
+            skip();
+            });
+        break;
+    case '[':
+        array([this]
+            {
+            skip();
+            });
+        break;
+    case '"':
+        string();
+        break;
+    case 't':
+    case 'f':
+    case 'n':
+        while(mPos<mS.size() && std::isalpha(static_cast<unsigned char>(mS[mPos])))
+            ++mPos;
+        break;
+    default:
+        number();
+    }
+}
+
+std::string mS;
+std::size_t mPos{};
+};
+
+//------------------------------------------------------------------------------
+/**
+Performance regression runner: the predefined presets times a fixed set of
+request sizes, each run rp.benchRuns() times with a reseeded generator, and
+summarized as median and MAD of throughput and median latency. Saves the
+summary as a JSON baseline, or compares against one and fails with
+ERRORS::REGRESSION when a workload is worse than the baseline by more than
+its noise band, or with ERRORS::ASSEMBLY when a workload fails.
+*/
+int baseline(
+    std::map<std::string,ProducerParams> const& predefined,
+    RunParams const& rp)
+{
+static const int SIZES[]{20,100,500};
+const double FRACTION{0.10};
+
+BaselineReader::Workloads base;
+if(!rp.baselineCheck().empty())
+    {
+    std::ifstream in(rp.baselineCheck());
+    if(!in.is_open())
+        {
+        LOG("Cannot open baseline " << rp.baselineCheck());
+        return ERRORS::BENCH_OUTPUT;
+        }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    try
+        {
+        base=BaselineReader(ss.str()).workloads();
+        }
+    catch(std::runtime_error const& e)
+        {
+        LOG("Malformed baseline " << rp.baselineCheck() << ": " << e.what());
+        return ERRORS::BENCH_OUTPUT;
+        }
+    if(base.empty())
+        {
+        LOG("No baseline workloads in: " << rp.baselineCheck());
+        return ERRORS::BENCH_OUTPUT;
+        }
+    }
+std::stringstream json;
+json << "{\"seed\":" << rp.seed() << ",\"runs\":" << rp.benchRuns()
+     << ",\"docs_per_run\":" << rp.benchDocs() << ",\"workloads\":[";
+DisNDat<> c("",",");
+int regressions{};
+for(auto const& [preset,pp]: predefined)
+    for(auto size: SIZES)
+        {
+        auto name{preset+"/"+std::to_string(size)};
+        std::vector<double> throughput,latency;
+        for(std::size_t run=0; run<rp.benchRuns(); ++run)
+            {
+            auto seeded{pp};
+            seeded.setSeed(rp.seed()+run);
+            WorkloadResult res;
+            try
+                {
+                res=runWorkload(seeded,{size,size,size,0},1,rp.benchDocs());
+                }
+            catch(std::runtime_error const& e)
+                {
+                LOG(name << ": " << e.what());
+                return ERRORS::ASSEMBLY;
+                }
+            throughput.push_back(res.docs/res.seconds);
+            latency.push_back(res.percentile(0.5));
+            }
+        Stat tput(throughput),lat(latency);
+        json << c << "\n{\"name\":\"" << name
+             << "\",\"docs_per_s\":{\"median\":" << tput.median
+             << ",\"mad\":" << tput.mad
+             << "},\"p50_ms\":{\"median\":" << lat.median
+             << ",\"mad\":" << lat.mad << "}}";
+        auto b{base.find(name)};
+        if(b==base.end())
+            {
+            if(!base.empty())
+                LOG(name << ": not in baseline");
+            continue;
+            }
+        auto const& [bt,bl]{b->second};
+        bool slower{tput.median<bt.median-bt.threshold(FRACTION)};
+        bool later{lat.median>bl.median+bl.threshold(FRACTION)};
+        regressions+=slower || later;
+        LOG(name << ": " << tput.median << " docs/s (baseline " << bt.median
+            << " +-" << bt.mad << "), p50 " << lat.median << " ms (baseline "
+            << bl.median << " +-" << bl.mad << ") "
+            << (slower || later ? "REGRESSION" : "ok"));
+        }
+json << "\n]}\n";
+if(!rp.baselineSave().empty())
+    {
+    std::ofstream out(rp.baselineSave(),std::ios::binary);
+    out << json.str();
+    if(!out.good())
+        {
+        LOG("Cannot write baseline: " << rp.baselineSave());
+        return ERRORS::BENCH_OUTPUT;
+        }
+    }
+if(regressions)
+    {
+    LOG(regressions << " workload(s) regressed");
+    return ERRORS::REGRESSION;
+    }
+return 0;
 }
 
 //------------------------------------------------------------------------------
@@ -1469,6 +5811,17 @@ void usage()
 LOG(
 R"(jsonizer usage:
 -h      : This help
+-q      : Quiet, no progress logging
+--numa  : Run one Producer per NUMA node, with its Parts allocated node
+         locally, and pin Producer and Assembly threads to their nodes,
+         routing requests round robin over the nodes. Applies to the
+         default and corpus modes; does nothing on a single node.
+-S [prefix]
+         Stream each JSON object into file <prefix><N>.json while it is
+         being assembled, N being the index of the -t constraint. The
+         file is named <prefix><N>.json.part until complete, and gets
+         removed if the object cannot be completed.
+         Example: -S /tmp/out_
 -s [N]  : Keys multiplier, adds e.g. _a ... _zzz postfix
          Example: -s 52
 -p [key]: Use predefined config
@@ -1482,11 +5835,146 @@ R"(jsonizer usage:
          K=keyed, I=integer, D=double, S=string, A=array, O=object,
          M=mixed type values.
          This param can be given several times.
+-e [queue|direct]
+         Generation engine: the assembly line (default), or direct
+         sampling of the same shapes, from the same -p/-c parameters,
+         straight into the output, bypassing the queues.
+--adaptive
+         Tune the consumer recirculation and weights of the queue engine
+         online, from the work queue composition and the Assemblies
+         waiting for products, starting at and bounded by the -p/-c ones.
+         Logs the parameters arrived at when the Producer stops.
+--queue-cap [N]
+         Most Parts waiting in the Producer work queue; further orders
+         wait for room, and recirculating Assemblies block. Unlimited by
+         default.
+--mem-budget [bytes]
+         Most bytes of Parts and Products held by a Producer, including
+         the Parts collected by its factories and its leftovers kept by
+         --recycle; further orders wait for room, and recirculating
+         Assemblies block. Accepts k, M and G suffixes. Unlimited by
+         default.
+--stock [low,high]
+         Warm stock: the Producer keeps finished products holding at
+         least low values of each type, refilling them up to high
+         (defaults to 2*low) while idle, so requests get served from
+         stock. Applies to the serve mode too.
+--keys [file]
+         Key names from a corpus file instead of the preset ones, one per
+         line, or in the binary format: the magic JSNZCRP1, the count n and
+         n+1 item offsets past the offsets, as 64 bit words, then the items.
+         The file gets mapped read-only and shared by all Producers.
+--values-ints [file]
+--values-doubles [file]
+--values-strings [file]
+         Value group of that type from a corpus file, formatted as for
+         --keys, replacing the preset groups of the type. Numbers must be
+         JSON number literals; strings get escaped as drawn. These params
+         can be given several times, one group each.
+--snapshot-save [file]
+         Write the predefined configurations, i.e. key names, rendered
+         value literals and factory parameters, as a flat image and exit.
+         Corpora given with --keys and --values-* get baked in.
+--snapshot-load [file]
+         Map a saved image read-only and configure the Producers from it
+         instead of initializing them; processes mapping the same image
+         share its pages.
+--recycle [seconds]
+         Keep the leftovers of finished Producers, i.e. unclaimed
+         products, queued parts and partially filled factory buffers,
+         for up to this many seconds to seed the next Producer of the
+         same configuration. Off by default.
 -t [int values,double values,string values]
          This represents one JSON file production constraints, i.e.
          a minimum of this many values of specified type will exist in
          the produced JSON object. Example: -t 100,100,100
-         This param can be given several times.)");
+         This param can be given several times.
+-b [bytes]
+         One JSON file production constraint by size: the produced JSON
+         object will be at least this many bytes. Accepts k, M and G
+         suffixes. Example: -b 10M
+         Fails once the top level keys are used up, see -s.
+         This param can be given several times.
+--corpus [N]
+         Bulk mode: generate N JSON objects, cycling through the -t
+         constraints, and report documents/s and MB/s. Requires --out.
+--out [path]
+         Corpus output: an NDJSON file if path ends with .ndjson,
+         otherwise a directory receiving one <N>.json file per object.
+-f [json|cbor|msgpack]
+         Output encoding, JSON text by default. CBOR and MessagePack get
+         written from the generated structure as a map per object,
+         numbers in binary, when the object is complete; file names end
+         in .cbor or .msgpack, and corpus output goes into one file when
+         --out ends that way. Not available with -e direct.
+-z [gzip|zstd]
+         Compress the -S streams, the --out corpus output and, given in
+         a --serve request, its payload, in blocks compressed in
+         parallel, each an independent gzip member or zstd frame. File
+         names get .gz or .zst appended. Only the codecs compiled in
+         with -DJSONIZER_ZLIB or -DJSONIZER_ZSTD are available.
+--z-level [N]
+         Compression level. Defaults to the codec default.
+--z-block [bytes]
+         Compression block size, with k, M and G suffixes. Defaults
+         to 1M.
+-j [N]  : Corpus worker count, each with its own Producer.
+         Defaults to the number of hardware threads.
+-m [text|prom]
+         Collect pipeline metrics and dump them at exit and on SIGUSR1,
+         as plain text or in Prometheus text format.
+-T [file]
+         Record producer and assembly thread activity and write it at
+         exit as Chrome trace-event JSON, viewable in chrome://tracing
+         and Perfetto.
+--bench-scaling [N]
+         Benchmark mode: run every predefined preset, with the engine,
+         queue, stock and corpus options given, with 1, 2, 4 ... N
+         concurrent requests of the first -t/-b constraint and report
+         documents/s, values/s, bytes/s and p50/p99 latency as JSON,
+         into --out if given, otherwise to stdout.
+--bench-docs [N]
+         Requests run back to back per concurrent requester in the
+         benchmark modes. Defaults to 20.
+--bench-escape [MB]
+         Benchmark the JSON string escaping over MB of generated strings
+         with the scalar, SSE2 and AVX2 scanners, best of --bench-runs,
+         reported as JSON into --out if given, otherwise to stdout.
+--baseline-save [file]
+--baseline-check [file]
+         Regression mode: run the predefined presets, with the engine,
+         queue, stock and corpus options given, on requests of
+         20, 100 and 500 values of each type, --bench-runs times each,
+         and save the median and MAD of throughput and latency as a
+         JSON baseline, and/or compare them against a saved baseline,
+         exiting with non-zero status on regression.
+--bench-runs [N]
+         Repetitions per regression workload. Defaults to 5.
+--seed [N]
+         Random generator seed. Producers draw from a random one unless
+         given; the regression workloads default to 1.
+--serve [port]
+         Serve requests on 127.0.0.1:port. A request is a line of the
+         -p, -c, -e, -s, -t, -b, -f, -z, --z-level, --z-block and
+         --adaptive arguments above, of at most 64 documents, each of
+         at most 100000 values per type or 64M bytes; the response is a
+         line with the payload size, followed by the JSON objects, one
+         per line, or back to back when binary, compressed as a whole
+         with -z, or ERR and the error code.
+--load [port]
+         Load generator against --serve on 127.0.0.1:port, reporting
+         throughput and a latency histogram.
+--concurrency [N]
+         Load generator connections. Defaults to 1.
+--rate [N]
+         Open loop arrival rate in requests/s over all connections;
+         without it the load generator runs closed loop.
+--duration [seconds]
+         Load generator run time. Defaults to 10.
+--mix [request;request...]
+         Load generator request mix, cycled through, e.g.
+         --mix "-p godbolt -t 10,10,10;-t 100,100,100".
+         Defaults to -t 70,70,70.)");
 }
 
 //------------------------------------------------------------------------------
@@ -1495,6 +5983,7 @@ int parseCmdline(
     char* argv[],
     ProducerParams& pp,
     V_Counts& counts,
+    RunParams& rp,
     std::map<std::string,ProducerParams> const& predefined)
 {
 auto splitz{[&](
@@ -1511,10 +6000,41 @@ auto splitz{[&](
             splitz(splitz,res,s,++pos2);
         }
     }};
+auto parseSize{[](std::string const& s)
+    {
+    std::size_t pos{};
+    std::size_t bytes{std::stoul(s,&pos)};
+    if(s[0]=='-' || pos+1<s.size())
+        throw std::invalid_argument(s);
+    if(pos<s.size())
+        switch(s[pos])
+            {
+            case 'k':
+                bytes<<=10;
+                break;
+            case 'M':
+                bytes<<=20;
+                break;
+            case 'G':
+                bytes<<=30;
+                break;
+            default:
+                throw std::invalid_argument(s);
+            }
+    return bytes;
+    }};
 try
     {
-    const std::set<std::string> KEYS_1{"-h"};
-    const std::set<std::string> KEYS_2{"-s","-p","-c","-t"};
+    const std::set<std::string> KEYS_1{"-h","-q","--numa","--adaptive"};
+    const std::set<std::string> KEYS_2{"-s","-p","-c","-e","-t","-b","-S"
+        ,"--corpus","--out","-j","-m","-T"
+        ,"--bench-scaling","--bench-docs","--baseline-save"
+        ,"--baseline-check","--bench-runs","--seed","--serve","--load"
+        ,"--concurrency","--rate","--duration","--mix","--queue-cap"
+        ,"--mem-budget","--recycle","--stock","--snapshot-save"
+        ,"--snapshot-load","--bench-escape","--keys","--values-ints"
+        ,"--values-doubles","--values-strings","-z","--z-level"
+        ,"--z-block","-f"};
     std::map<std::string,std::vector<std::string>> candidates;
     for(int i=1; i<argc; ++i)
         {
@@ -1523,7 +6043,10 @@ try
             int j=i+1;
             if(!strcmp(argv[i],"-h")
                || (j<argc && KEYS_2.find(argv[j])==KEYS_2.end()))
+                {
                 candidates[argv[i]].push_back(argv[j]);
+                i=j;
+                }
             }
         else if(KEYS_1.find(argv[i])!=KEYS_1.end())
             candidates[argv[i]];
@@ -1544,6 +6067,146 @@ try
         for(auto i: k->second)
             pp.setKeyMultiplier(std::stoi(i));
 
+    if(candidates.find("-q")!=candidates.end())
+        g_verbose=false;
+
+    if(candidates.find("--numa")!=candidates.end())
+        rp.setNuma(true);
+
+    k=candidates.find("--corpus");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setCorpus(std::stoul(i));
+
+    k=candidates.find("--out");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setOut(i);
+
+    k=candidates.find("-j");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setJobs(std::stoul(i));
+
+    k=candidates.find("-m");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            {
+            if(i!="text" && i!="prom")
+                throw std::invalid_argument(i);
+            rp.setMetrics(i);
+            }
+
+    k=candidates.find("--bench-scaling");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setBenchScaling(std::stoul(i));
+
+    k=candidates.find("--bench-escape");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setBenchEscape(std::stoul(i));
+
+    k=candidates.find("--bench-docs");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setBenchDocs(std::stoul(i));
+
+    k=candidates.find("--baseline-save");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setBaselineSave(i);
+
+    k=candidates.find("--baseline-check");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setBaselineCheck(i);
+
+    k=candidates.find("--bench-runs");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setBenchRuns(std::stoul(i));
+
+    k=candidates.find("--serve");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setServe(std::stoi(i));
+
+    k=candidates.find("--load");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setLoad(std::stoi(i));
+
+    k=candidates.find("--concurrency");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setConcurrency(std::max(1ul,std::stoul(i)));
+
+    k=candidates.find("--rate");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setRate(std::stod(i));
+
+    k=candidates.find("--duration");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setDuration(std::stod(i));
+
+    k=candidates.find("--mix");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setMix(i);
+
+    k=candidates.find("--snapshot-save");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setSnapshotSave(i);
+
+    k=candidates.find("--recycle");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setRecycle(std::stod(i));
+
+    k=candidates.find("-T");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setTrace(i);
+
+    k=candidates.find("-z");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            {
+            auto format{Compressor::parse(i)};
+            if(!format)
+                {
+                usage();
+                return ERRORS::USAGE;
+                }
+            if(!Compressor::available(*format))
+                throw std::runtime_error(i+" compression not built in");
+            rp.compressor().setFormat(*format);
+            }
+
+    k=candidates.find("--z-level");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.compressor().setLevel(std::stoi(i));
+
+    k=candidates.find("--z-block");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.compressor().setBlockSize(parseSize(i));
+
+    if(rp.corpus() && rp.out().empty())
+        {
+        usage();
+        return ERRORS::CMDLINE_MISSING_OUTPUT;
+        }
+    k=candidates.find("-S");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            rp.setStreamPrefix(i);
+
     k=candidates.find("-p");
     if(k!=candidates.end())
         for(auto i: k->second)
@@ -1598,16 +6261,95 @@ try
             if(vv!=v.end())
                 maxSize=std::stoi(*vv++);
 
-            if(vv!=v.end())
-                recirc=std::stoi(*vv++);
+            if(vv!=v.end())
+                recirc=std::stoi(*vv++);
+
+            if(vv!=v.end())
+                weigth=std::stoi(*vv++);
+
+            pp.setConsumerParam(
+                KEYS.find(key)->second,{minSize,maxSize,recirc,weigth});
+            }
+        }
+    k=candidates.find("-e");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            {
+            if(i!="queue" && i!="direct")
+                {
+                usage();
+                return ERRORS::USAGE;
+                }
+            pp.setEngine(i=="queue" ? ProducerParams::Engine::QUEUE
+                : ProducerParams::Engine::DIRECT);
+            }
+    if(candidates.find("--adaptive")!=candidates.end())
+        {
+        if(pp.engine()==ProducerParams::Engine::DIRECT)
+            throw std::runtime_error("--adaptive needs the queue engine");
+        pp.setAdaptive(true);
+        }
+
+    k=candidates.find("--seed");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            {
+            rp.setSeed(std::stoul(i));
+            pp.setSeed(rp.seed());
+            }
+
+    k=candidates.find("-f");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            {
+            auto format{Encoder::parse(i)};
+            if(!format)
+                {
+                usage();
+                return ERRORS::USAGE;
+                }
+            rp.setEncoding(*format);
+            }
+    if(rp.encoding()!=Encoder::Format::JSON
+       && pp.engine()==ProducerParams::Engine::DIRECT)
+        throw std::runtime_error("-f cbor and msgpack need the queue engine");
+
+    k=candidates.find("--keys");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            pp.setKeyCorpus(Corpus::load(i,false));
 
-            if(vv!=v.end())
-                weigth=std::stoi(*vv++);
+    for(auto [key,type]: {
+         std::make_pair("--values-ints",Part::SimpleType::INT)
+        ,std::make_pair("--values-doubles",Part::SimpleType::DOUBLE)
+        ,std::make_pair("--values-strings",Part::SimpleType::STRING)})
+        {
+        k=candidates.find(key);
+        if(k!=candidates.end())
+            for(auto i: k->second)
+                pp.addValueCorpus(type,Corpus::load(
+                    i,type!=Part::SimpleType::STRING));
+        }
+    k=candidates.find("--queue-cap");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            pp.setQueueCapacity(std::stoul(i));
 
-            pp.setConsumerParam(
-                KEYS.find(key)->second,{minSize,maxSize,recirc,weigth});
+    k=candidates.find("--mem-budget");
+    if(k!=candidates.end())
+        for(auto i: k->second)
+            pp.setMemoryBudget(parseSize(i));
+
+    k=candidates.find("--stock");
+    if(k!=candidates.end())
+        for(auto ii: k->second)
+            {
+            std::vector<std::string> v;
+            splitz(splitz,v,ii);
+            auto low{std::stoul(v.front())};
+            pp.setStock(low,v.size()>1 ? std::stoul(v[1]) : 2*low);
             }
-        }
+
     k=candidates.find("-t");
     if(k!=candidates.end())
         {
@@ -1619,20 +6361,36 @@ try
             i=d=s=0;
             auto vv{v.begin()};
             if(vv!=v.end())
-                if(!vv++->empty())
+                {
+                if(!vv->empty())
                     d=s=i=std::stoi(*vv);
-
+                ++vv;
+                }
             if(vv!=v.end())
-                if(!vv++->empty())
+                {
+                if(!vv->empty())
                     d=s=std::stoi(*vv);
-
+                ++vv;
+                }
             if(vv!=v.end())
                 if(!vv->empty())
-                s=std::stoi(*vv);
+                    s=std::stoi(*vv);
 
-            counts.push_back({i,d,s});
+            if(i<0 || d<0 || s<0)
+                throw std::invalid_argument(ii);
+
+            counts.push_back({i,d,s,0});
             }
         }
+    k=candidates.find("-b");
+    if(k!=candidates.end())
+        for(auto ii: k->second)
+            counts.push_back({0,0,0,parseSize(ii)});
+    }
+catch(std::runtime_error const& e)
+    {
+    LOG(e.what());
+    return ERRORS::CMDLINE_EXCEPTION;
     }
 catch(...)
     {
@@ -1649,106 +6407,766 @@ catch(...)
 return 0;
 }
 
+template<typename... P> void initPresets(
+    std::map<std::string,ProducerParams>& ppp,
+    ProducerParams const& pp,
+    std::tuple<P...>*)
+{
+auto impl{[&](auto preset)
+    {
+    using T=decltype(preset);
+    ProducerParams::M_ConsumerParams cons;
+    for(std::size_t i=0; i<T::TABLE.size(); ++i)
+        cons[static_cast<CT>(i)]=T::TABLE[i];
+
+    auto& p{ppp[T::NAME]=pp};
+    p.setConsumerParams(cons);
+    p.setPreset(T::NAME);
+    }};
+(impl(P{}),...);
+}
+
 std::map<std::string,ProducerParams> initPredefined()
 {
-ProducerParams pp,pp2;
-initProducerKeys(pp2);
-initProducerKeysMultiplier(pp2);
-initProducerValues(pp2);
-
-using f=std::function<void()>;
-static std::map<std::string,f> CONSUMERS{
-    {"godbolt",[&pp]{
-        pp.setConsumerParams({
-             {CT::KI,{0,0,90,1}}
-            ,{CT::KD,{0,0,90,1}}
-            ,{CT::KS,{0,0,90,1}}
-            ,{CT::AI,{4,12,80,1}}
-            ,{CT::AD,{3,11,80,1}}
-            ,{CT::AS,{2,10,80,1}}
-            ,{CT::AO,{2,6,40,1}}
-            ,{CT::AA,{3,5,40,1}}
-            ,{CT::AM,{2,4,40,1}}
-            ,{CT::OI,{3,5,40,1}}
-            ,{CT::OD,{4,5,40,1}}
-            ,{CT::OS,{2,5,40,1}}
-            ,{CT::OA,{4,8,30,1}}
-            ,{CT::OO,{3,7,30,1}}
-            ,{CT::OM,{2,6,30,1}}
-            });}}
-    ,{"complex",[&pp]{
-        pp.setConsumerParams({
-             {CT::KI,{0,0,90,1}}
-            ,{CT::KD,{0,0,90,1}}
-            ,{CT::KS,{0,0,90,1}}
-            ,{CT::AI,{4,12,80,1}}
-            ,{CT::AD,{3,11,80,1}}
-            ,{CT::AS,{2,10,80,1}}
-            ,{CT::AO,{2,6,80,1}}
-            ,{CT::AA,{3,5,80,1}}
-            ,{CT::AM,{2,4,80,1}}
-            ,{CT::OI,{3,5,80,1}}
-            ,{CT::OD,{4,5,80,1}}
-            ,{CT::OS,{2,5,80,1}}
-            ,{CT::OA,{4,8,90,1}}
-            ,{CT::OO,{3,7,90,1}}
-            ,{CT::OM,{2,6,90,1}}
-            });}}
-    ,{"default",[&pp]{
-        pp.setConsumerParams({
-             {CT::KI,{1,2,50,1}}
-            ,{CT::KD,{1,2,50,1}}
-            ,{CT::KS,{1,2,50,1}}
-            ,{CT::AI,{1,2,50,1}}
-            ,{CT::AD,{1,2,50,1}}
-            ,{CT::AS,{1,2,50,1}}
-            ,{CT::AO,{1,2,50,1}}
-            ,{CT::AA,{1,2,50,1}}
-            ,{CT::AM,{1,2,50,1}}
-            ,{CT::OI,{1,2,50,1}}
-            ,{CT::OD,{1,2,50,1}}
-            ,{CT::OS,{1,2,50,1}}
-            ,{CT::OA,{1,2,50,1}}
-            ,{CT::OO,{1,2,50,1}}
-            ,{CT::OM,{1,2,50,1}}
-            });}}};
+ProducerParams pp;
+initProducerKeys(pp);
+initProducerKeysMultiplier(pp);
+initProducerValues(pp);
+// Rendered once, shared by the presets and the Producers
+pp.setPools(pp.pools());
+
 std::map<std::string,ProducerParams> ppp;
-for(auto& [k,v]: CONSUMERS)
+initPresets(ppp,pp,static_cast<Presets*>(nullptr));
+return ppp;
+}
+
+//------------------------------------------------------------------------------
+/**
+Warm-state image of the predefined Producer configurations: key names,
+rendered value literals and factory parameters, laid out flat with file
+relative offsets, so the file can be mapped read-only anywhere and its pages
+shared between processes. Producers configured from a loaded Snapshot draw
+keys and literals right from the mapping. Layout, in 64 bit words:
+  header:   magic, file size, entry count, offset of the entry offsets
+  entry:    name, preset, key multiplier, keys, 3 literal groups,
+            consumer count, then (CT,min,max,recirc,weigth) per consumer
+  string:   offset, size
+  strings:  count, then the strings
+  groups:   count, then the offsets of their strings
+Key tables and literal groups shared by the presets are stored once, their
+entries pointing at the same strings, and get shared again when loaded.
+*/
+struct Snapshot : public std::enable_shared_from_this<Snapshot>
+{
+static constexpr std::uint64_t MAGIC{0x31504e535a4e534aull}; // "JSNZSNP1"
+
+static bool save(
+    std::string const& path,
+    std::map<std::string,ProducerParams> const& predefined)
+{
+std::string image(4*sizeof(std::uint64_t),'\0');
+auto put{[&image](std::uint64_t w)
+    {
+    image.resize((image.size()+sizeof w-1)/sizeof w*sizeof w,'\0');
+    auto off{image.size()};
+    image.append(reinterpret_cast<char const*>(&w),sizeof w);
+    return off;
+    }};
+auto patch{[&image](std::size_t off, std::uint64_t w)
+    {
+    memcpy(image.data()+off,&w,sizeof w);
+    }};
+// Raw strings of corpora get stored rendered, keys escaped, values quoted too
+auto strings{[&](Pools::V_SV const& v, bool raw=false, bool quote=false)
+    {
+    std::vector<std::uint64_t> offs, sizes;
+    for(auto const& i: v)
+        {
+        offs.push_back(image.size());
+        if(quote)
+            image+='"';
+        if(raw)
+            appendEscaped(image,i);
+        else
+            image.append(i);
+        if(quote)
+            image+='"';
+        sizes.push_back(image.size()-offs.back());
+        }
+    auto off{put(v.size())};
+    for(std::size_t i=0; i<v.size(); ++i)
+        {
+        put(offs[i]);
+        put(sizes[i]);
+        }
+    return off;
+    }};
+// Each distinct pool once, by the list viewed; offset 0 is the header
+std::map<std::tuple<Pools::V_SV const*,bool,bool>,std::uint64_t> stored;
+auto pool{[&](Pools::Views const& v, bool raw=false, bool quote=false)
+    {
+    auto& off{stored[{v.get(),raw,quote}]};
+    if(!off)
+        off=strings(*v,raw,quote);
+    return off;
+    }};
+std::vector<std::uint64_t> entries;
+for(auto const& [name,pp]: predefined)
     {
-    pp=pp2;
-    v();
-    ppp[k]=pp;
+    auto pools{pp.pools()};
+    auto names{strings({name,pp.preset()})};
+    auto keys{pool(pools.keys,pools.rawKeys)};
+    std::array<std::uint64_t,3> literals;
+    for(std::size_t t=0; t<literals.size(); ++t)
+        {
+        auto raw{pools.rawStrings
+            && t==static_cast<std::size_t>(Part::SimpleType::STRING)};
+        std::vector<std::uint64_t> groups;
+        for(auto const& i: pools.literals[t])
+            groups.push_back(pool(i,raw,raw));
+        literals[t]=put(groups.size());
+        for(auto i: groups)
+            put(i);
+        }
+    entries.push_back(put(names));
+    put(pp.keyMultiplier());
+    put(keys);
+    for(auto i: literals)
+        put(i);
+    put(pp.consumerParams().size());
+    for(auto const& [ct,cp]: pp.consumerParams())
+        for(auto w: {static_cast<std::size_t>(ct),cp.min,cp.max,cp.recirc
+            ,cp.weigth})
+            put(w);
     }
-return ppp;
+auto table{put(entries.size())};
+for(auto i: entries)
+    put(i);
+patch(0,MAGIC);
+patch(8,image.size());
+patch(16,entries.size());
+patch(24,table+sizeof(std::uint64_t));
+
+std::ofstream out(path,std::ios::binary);
+out.write(image.data(),image.size());
+return static_cast<bool>(out.flush());
+}
+
+// Maps path and checks it, returning nullptr when it is no valid Snapshot
+static std::shared_ptr<Snapshot> load(std::string const& path)
+{
+std::shared_ptr<Snapshot> snapshot;
+try
+    {
+    snapshot.reset(new Snapshot(path));
+    snapshot->predefined();
+    }
+catch(std::exception const& e)
+    {
+    LOG("Invalid snapshot " << path << ": " << e.what());
+    return nullptr;
+    }
+return snapshot;
+}
+
+// Producer configurations referencing the mapping, which they keep alive
+std::map<std::string,ProducerParams> predefined() const
+{
+if(word(0)!=MAGIC || word(8)!=mFile.size())
+    throw std::invalid_argument("bad header");
+
+std::map<std::string,ProducerParams> predefined;
+// The views of the strings at an offset, shared by the entries pointing there
+struct List
+{
+std::shared_ptr<Snapshot const> snapshot;
+Pools::V_SV strings;
+};
+std::map<std::uint64_t,Pools::Views> lists;
+auto list{[&](std::uint64_t off)
+    {
+    auto& views{lists[off]};
+    if(!views)
+        {
+        auto l{std::make_shared<List>()};
+        l->snapshot=shared_from_this();
+        l->strings=strings(off);
+        views=Pools::views(l,l->strings);
+        }
+    return views;
+    }};
+auto table{word(24)};
+for(std::uint64_t n=word(16); n; --n, table+=sizeof(std::uint64_t))
+    {
+    auto off{word(table)};
+    auto next{[&]{ auto w{word(off)}; off+=sizeof w; return w; }};
+    auto names{strings(next())};
+    if(names.size()!=2)
+        throw std::invalid_argument("bad entry");
+
+    ProducerParams pp;
+    pp.setKeyMultiplier(next());
+    Pools pools;
+    pools.keys=list(next());
+    for(auto& i: pools.literals)
+        {
+        auto groups{next()};
+        for(auto g{word(groups)}; g; --g)
+            i.push_back(list(word(groups+=sizeof(std::uint64_t))));
+        }
+    pp.setPools(pools);
+    ProducerParams::M_ConsumerParams cons;
+    for(auto c{next()}; c; --c)
+        {
+        auto ct{next()};
+        if(ct>=CT_COUNT)
+            throw std::invalid_argument("bad factory");
+        auto& cp{cons[static_cast<CT>(ct)]};
+        cp.min=next();
+        cp.max=next();
+        cp.recirc=next();
+        cp.weigth=next();
+        }
+    pp.setConsumerParams(cons);
+    pp.setPreset(std::string(names[1]));
+    predefined[std::string(names[0])]=pp;
+    }
+return predefined;
+}
+
+private:
+
+explicit Snapshot(std::string const& path)
+    : mFile(path)
+{}
+
+std::uint64_t word(std::uint64_t off) const
+{
+if(off%sizeof(std::uint64_t) || off+sizeof(std::uint64_t)>mFile.size())
+    throw std::out_of_range("word at "+std::to_string(off));
+
+std::uint64_t w;
+memcpy(&w,mFile.data()+off,sizeof w);
+return w;
+}
+
+Pools::V_SV strings(std::uint64_t off) const
+{
+auto size{mFile.size()};
+auto count{word(off)};
+if(count>size/sizeof(std::uint64_t))
+    throw std::out_of_range("strings at "+std::to_string(off));
+
+Pools::V_SV v(count);
+for(auto& i: v)
+    {
+    off+=sizeof(std::uint64_t);
+    auto beg{word(off)};
+    off+=sizeof(std::uint64_t);
+    auto len{word(off)};
+    if(beg>size || len>size-beg)
+        throw std::out_of_range("string at "+std::to_string(beg));
+    i={mFile.data()+beg,len};
+    }
+return v;
+}
+
+MappedFile mFile;
+};
+
+//------------------------------------------------------------------------------
+/**
+Loopback TCP connection of the line protocol used by --serve and --load.
+A request is one line of command line arguments (e.g. -p godbolt -t 9,9,9).
+The response is a line holding the payload size in bytes, followed by the
+produced JSON objects separated by newlines, or the line ERR <code>.
+*/
+struct Connection
+{
+explicit Connection(int fd)
+    : mFd(fd)
+{}
+
+Connection(Connection const&)=delete;
+Connection& operator=(Connection const&)=delete;
+
+~Connection()
+{
+if(mFd>=0)
+    close(mFd);
+}
+
+static int connectLoopback(int port)
+{
+int fd{socket(AF_INET,SOCK_STREAM,0)};
+sockaddr_in addr{};
+addr.sin_family=AF_INET;
+addr.sin_port=htons(port);
+addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+if(fd>=0 && connect(fd,reinterpret_cast<sockaddr*>(&addr),sizeof addr))
+    {
+    close(fd);
+    fd=-1;
+    }
+return fd;
+}
+
+bool good() const
+{
+return mFd>=0;
+}
+
+bool readLine(std::string& line)
+{
+line.clear();
+for(;;)
+    {
+    auto pos{mBuf.find('\n')};
+    if(pos!=std::string::npos)
+        {
+        line=mBuf.substr(0,pos);
+        mBuf.erase(0,pos+1);
+        return true;
+        }
+    if(!fill())
+        return false;
+    }
+}
+
+bool read(std::size_t n, std::string& data)
+{
+while(mBuf.size()<n)
+    if(!fill())
+        return false;
+data=mBuf.substr(0,n);
+mBuf.erase(0,n);
+return true;
+}
+
+bool write(std::string const& data)
+{
+std::size_t done{};
+while(done<data.size())
+    {
+    auto n{send(mFd,data.data()+done,data.size()-done,MSG_NOSIGNAL)};
+    if(n<=0)
+        return false;
+    done+=n;
+    }
+return true;
+}
+
+private:
+
+bool fill()
+{
+char buf[64*1024];
+auto n{recv(mFd,buf,sizeof buf,0)};
+if(n<=0)
+    return false;
+mBuf.append(buf,n);
+return true;
+}
+
+int mFd{-1};
+std::string mBuf;
+};
+
+//------------------------------------------------------------------------------
+/**
+Splits a request line into an argv for parseCmdline(). Documents are bounded
+to MAX_REQUEST_COUNT items per -t type and MAX_REQUEST_BYTES per -b, as are
+the documents of a request in total.
+*/
+int parseRequest(
+    std::string const& line,
+    ProducerParams& pp,
+    V_Counts& counts,
+    RunParams& rp,
+    std::map<std::string,ProducerParams> const& predefined)
+{
+static const std::set<std::string> KEYS{"-p","-c","-e","-s","-t","-b","-z"
+    ,"--z-level","--z-block","-f","--adaptive"};
+std::vector<std::string> args{"jsonizer"};
+std::stringstream ss(line);
+for(std::string arg; ss >> arg;)
+    if(arg[0]=='-' && KEYS.find(arg)==KEYS.end())
+        return ERRORS::USAGE;
+    else
+        args.push_back(arg);
+
+std::vector<char*> argv;
+for(auto& i: args)
+    argv.push_back(i.data());
+
+static constexpr int MAX_REQUEST_COUNT{100000};
+static constexpr std::size_t MAX_REQUEST_BYTES{64<<20};
+static constexpr std::size_t MAX_REQUEST_DOCS{64};
+
+pp=predefined.find("default")->second;
+auto r{parseCmdline(argv.size(),argv.data(),pp,counts,rp,predefined)};
+if(!r && counts.empty())
+    counts.push_back({70,70,70,0});
+if(counts.size()>MAX_REQUEST_DOCS)
+    return ERRORS::USAGE;
+for(auto [i,d,s,b]: counts)
+    if(i>MAX_REQUEST_COUNT || d>MAX_REQUEST_COUNT || s>MAX_REQUEST_COUNT
+       || b>MAX_REQUEST_BYTES)
+        return ERRORS::USAGE;
+return r;
+}
+
+//------------------------------------------------------------------------------
+/**
+Request serving front end on the loopback interface. Requests using a preset
+as configured share one long lived Producer per preset, started up front when
+keeping warm stock; custom (-c) ones, and those varying a preset by -s, -e or
+--adaptive, get a Producer of their own, stopped after the request, so that
+clients cannot pile up Producers.
+*/
+int serve(int port, std::map<std::string,ProducerParams> const& predefined)
+{
+int fd{socket(AF_INET,SOCK_STREAM,0)};
+int one{1};
+setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof one);
+sockaddr_in addr{};
+addr.sin_family=AF_INET;
+addr.sin_port=htons(port);
+addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+if(fd<0 || bind(fd,reinterpret_cast<sockaddr*>(&addr),sizeof addr)
+   || listen(fd,128))
+    {
+    LOG("Cannot listen on port " << port);
+    return ERRORS::SERVE;
+    }
+std::mutex mux;
+std::map<std::string,std::shared_ptr<Producer>> producers;
+auto shared{[&](ProducerParams const& pp)
+    {
+    auto i{predefined.find(pp.preset())};
+    return !pp.preset().empty() && i!=predefined.end()
+        && i->second.signature()==pp.signature();
+    }};
+auto producer{[&](ProducerParams const& pp)
+    {
+    auto start{[](std::shared_ptr<Producer> prod)
+        {
+        std::thread([prod]
+            {
+            traceThread("producer");
+            prod->produce();
+            }).detach();
+        return prod;
+        }};
+    if(!shared(pp))
+        return start(std::make_shared<Producer>(pp));
+
+    std::lock_guard lock{mux};
+    auto& prod{producers[pp.signature()]};
+    if(!prod)
+        prod=start(std::make_shared<Producer>(pp));
+    return prod;
+    }};
+// Warm stock gets built before the first request
+for(auto const& [name,params]: predefined)
+    if(params.stockHigh())
+        producer(params);
+LOG("Serving on 127.0.0.1:" << port);
+for(;;)
+    {
+    int conn{accept(fd,nullptr,nullptr)};
+    if(conn<0)
+        continue;
+
+    std::thread([conn,&producer,&shared,&predefined]
+        {
+        Connection c(conn);
+        for(std::string line; c.readLine(line);)
+            {
+            ProducerParams pp;
+            V_Counts counts;
+            RunParams rp;
+            auto r{parseRequest(line,pp,counts,rp,predefined)};
+            if(r)
+                {
+                if(!c.write("ERR "+std::to_string(r)+"\n"))
+                    break;
+                continue;
+                }
+            auto prod{producer(pp)};
+            std::string payload;
+            try
+                {
+                for(auto const& i: counts)
+                    {
+                    Assembly a{prod,i,nullptr,rp.encoding()};
+                    payload+=a.run();
+                    if(rp.encoding()==Encoder::Format::JSON)
+                        payload+='\n';
+                    }
+                }
+            catch(std::runtime_error const&)
+                {
+                r=ERRORS::ASSEMBLY;
+                }
+            if(!shared(pp))
+                prod->done();
+            if(r)
+                {
+                if(!c.write("ERR "+std::to_string(r)+"\n"))
+                    break;
+                continue;
+                }
+            payload=rp.compressor().compress(payload);
+            if(!c.write(std::to_string(payload.size())+"\n"+payload))
+                break;
+            }
+        }).detach();
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+Load generator for --serve: rp.concurrency() connections cycling through the
+request mix for rp.duration() seconds. With rp.rate() requests/s it runs
+open loop, each request having a scheduled send time and its latency being
+measured from that time, so a stalled server is charged for the requests it
+kept waiting (coordinated omission). Without a rate it runs closed loop, and
+latencies longer than the running mean also record the requests that would
+have been sent meanwhile, as HdrHistogram's expected interval correction does.
+*/
+int load(
+    int port,
+    std::map<std::string,ProducerParams> const& predefined,
+    RunParams const& rp)
+{
+std::vector<std::string> mix;
+std::stringstream ss(rp.mix());
+for(std::string i; std::getline(ss,i,';');)
+    {
+    ProducerParams pp;
+    V_Counts counts;
+    RunParams r;
+    if(parseRequest(i,pp,counts,r,predefined))
+        return ERRORS::CMDLINE_EXCEPTION;
+    mix.push_back(i+"\n");
+    }
+if(mix.empty())
+    mix.push_back("-t 70,70,70\n");
+
+using Clock=std::chrono::steady_clock;
+auto n{rp.concurrency()};
+auto interval{rp.rate() ? std::chrono::duration<double>(n/rp.rate())
+    : std::chrono::duration<double>(0)};
+auto beg{Clock::now()};
+auto stop{beg+std::chrono::duration<double>(rp.duration())};
+std::mutex mux;
+std::vector<double> latencies;
+std::size_t requests{},errors{},bytes{};
+std::deque<std::future<void>> futs;
+for(std::size_t j=0; j<n; ++j)
+    futs.push_back(std::async(std::launch::async,[&,j]
+        {
+        Connection c(Connection::connectLoopback(port));
+        std::vector<double> lat;
+        std::size_t req{},err{},got{};
+        double mean{};
+        auto next{beg+std::chrono::duration_cast<Clock::duration>(
+            interval*j/static_cast<double>(n))};
+        for(std::size_t k=j; c.good(); ++k)
+            {
+            auto start{rp.rate() ? next : Clock::now()};
+            if(start>=stop)
+                break;
+            std::this_thread::sleep_until(start);
+            std::string line,payload;
+            if(!c.write(mix[k%mix.size()]) || !c.readLine(line))
+                {
+                ++err;
+                break;
+                }
+            std::size_t size{};
+            auto [p,ec]{std::from_chars(
+                line.data(),line.data()+line.size(),size)};
+            if(line.compare(0,3,"ERR")==0)
+                ++err;
+            else if(ec!=std::errc{} || p!=line.data()+line.size()
+                    || !c.read(size,payload))
+                {
+                ++err;
+                break;
+                }
+            got+=payload.size();
+            auto ms{std::chrono::duration<double,std::milli>(
+                Clock::now()-start).count()};
+            lat.push_back(ms);
+            ++req;
+            if(!rp.rate())
+                {
+                mean+=(ms-mean)/req;
+                for(auto i{ms-mean}; mean>0 && i>=mean; i-=mean)
+                    lat.push_back(i);
+                }
+            next+=std::chrono::duration_cast<Clock::duration>(interval);
+            }
+        if(!c.good())
+            ++err;
+        std::lock_guard lock{mux};
+        latencies.insert(latencies.end(),lat.begin(),lat.end());
+        requests+=req;
+        errors+=err;
+        bytes+=got;
+        }));
+
+for(auto& i: futs)
+    try
+        {
+        i.get();
+        }
+    catch(std::exception const& e)
+        {
+        LOG("Load connection failed: " << e.what());
+        ++errors;
+        }
+
+auto secs{std::chrono::duration<double>(Clock::now()-beg).count()};
+WorkloadResult res;
+res.latencies=latencies;
+Histogram h;
+for(auto i: latencies)
+    h.record(static_cast<std::uint64_t>(i*1000));
+std::stringstream report;
+report << (rp.rate() ? "Open" : "Closed") << " loop load, " << n
+       << " connections, " << secs << " s: " << requests << " requests ("
+       << requests/secs << "/s), " << errors << " errors, "
+       << bytes/1e6/secs << " MB/s\nlatency ms: p50 " << res.percentile(0.5)
+       << ", p90 " << res.percentile(0.9) << ", p99 " << res.percentile(0.99)
+       << ", p99.9 " << res.percentile(0.999) << ", max "
+       << res.percentile(1.0) << "\nlatency us histogram:";
+for(std::size_t i=0; i<Histogram::BUCKETS; ++i)
+    if(h.bucket(i))
+        report << "\n  < " << (std::uint64_t{1}<<i) << ": " << h.bucket(i);
+LOG(report.str());
+return errors ? ERRORS::LOAD : 0;
 }
 
 int main(int argc, char* argv[])
 {
 V_Counts counts;
-std::map<std::string,ProducerParams> predefined{initPredefined()};
+RunParams rp;
+std::shared_ptr<Snapshot> snapshot;
+for(int i=1; i+1<argc; ++i)
+    if(!strcmp(argv[i],"--snapshot-load"))
+        {
+        snapshot=Snapshot::load(argv[i+1]);
+        if(!snapshot)
+            exit(ERRORS::SNAPSHOT);
+        }
+std::map<std::string,ProducerParams> predefined{
+    snapshot ? snapshot->predefined() : initPredefined()};
 ProducerParams pp{predefined.find("default")->second};
-auto r{parseCmdline(argc,argv,pp,counts,predefined)};
+auto r{parseCmdline(argc,argv,pp,counts,rp,predefined)};
 if(r)
     exit(r);
 
 static const V_Counts defaultCounts{
-     {70,70,70}
-    ,{60,60,60}
-    ,{50,50,50}
-    ,{40,40,40}
-    ,{30,30,30}
-    ,{20,20,20}
+     {70,70,70,0}
+    ,{60,60,60,0}
+    ,{50,50,50,0}
+    ,{40,40,40,0}
+    ,{30,30,30,0}
+    ,{20,20,20,0}
     };
 if(counts.empty())
     counts=defaultCounts;
 
-auto beg{std::chrono::steady_clock::now()};
-auto results{threadize(pp,counts)};
-auto end{std::chrono::steady_clock::now()};
-auto t{std::chrono::duration_cast<std::chrono::nanoseconds>(end-beg).count()};
-double d{1.0*t/1000000.0};
-LOG("RUN took: " << d << " ms");
-LOG("created " << results.size() << " JSON files");
-for(auto const& i: results)
-    LOG("Result: " << i << '\n');
+std::optional<MetricsReporter> reporter;
+if(!rp.metrics().empty())
+    reporter.emplace(rp.metrics()=="prom");
+
+if(!rp.trace().empty())
+    {
+    Tracer::instance().enable();
+    traceThread("main");
+    }
+if(rp.recycle()>0)
+    Inventory::instance().enable(rp.recycle());
+if(!rp.snapshotSave().empty())
+    {
+    for(auto& [name,params]: predefined)
+        params.setRuntime(pp);
+    r=Snapshot::save(rp.snapshotSave(),predefined) ? ERRORS::NO
+        : ERRORS::SNAPSHOT;
+    }
+else if(rp.corpus())
+    {
+    g_verbose=false;
+    r=corpus(pp,counts,rp);
+    }
+else if(rp.serve())
+    {
+    g_verbose=false;
+    for(auto& [name,params]: predefined)
+        params.setRuntime(pp);
+    r=serve(rp.serve(),predefined);
+    }
+else if(rp.load())
+    {
+    g_verbose=false;
+    r=load(rp.load(),predefined,rp);
+    }
+else if(!rp.baselineSave().empty() || !rp.baselineCheck().empty())
+    {
+    g_verbose=false;
+    for(auto& [name,params]: predefined)
+        params.setRuntime(pp);
+    r=baseline(predefined,rp);
+    }
+else if(rp.benchEscape())
+    {
+    g_verbose=false;
+    r=benchEscape(rp);
+    }
+else if(rp.benchScaling())
+    {
+    g_verbose=false;
+    for(auto& [name,params]: predefined)
+        params.setRuntime(pp);
+    r=benchScaling(predefined,counts.front(),rp);
+    }
+else
+    {
+    auto beg{std::chrono::steady_clock::now()};
+    std::set<std::string> results;
+    try
+        {
+        results=threadize(pp,counts,rp);
+        }
+    catch(std::runtime_error const& e)
+        {
+        LOG(e.what());
+        r=ERRORS::ASSEMBLY;
+        }
+    auto end{std::chrono::steady_clock::now()};
+    auto t{std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end-beg).count()};
+    double d{1.0*t/1000000.0};
+    LOG("RUN took: " << d << " ms");
+    LOG("created " << results.size() << " JSON files");
+    // Binary objects get shown in hex, unless streamed to files
+    auto binary{rp.encoding()!=Encoder::Format::JSON && !rp.streaming()};
+    for(auto const& i: results)
+        {
+        std::stringstream ss;
+        if(binary)
+            for(unsigned char c: i)
+                ss << std::hex << std::setw(2) << std::setfill('0') << +c;
+        else
+            ss << i;
+        LOG("Result: " << ss.str() << '\n');
+        }
+    }
+if(!rp.trace().empty() && !Tracer::instance().write(rp.trace()))
+    LOG("Cannot write trace: " << rp.trace());
+return r;
 }
\ No newline at end of file